@@ -4,6 +4,7 @@
 #include "kernel/utils.h"
 #include "kernel/rtlil.h"
 #include "kernel/sigtools.h"
+#include "threads.h"
 
 USING_YOSYS_NAMESPACE
 PRIVATE_NAMESPACE_BEGIN
@@ -36,6 +37,15 @@ Const adjust_lut(Const val, int negated_input)
 	return val;
 }
 
+// A $_NOT_ gate or a single-input $lut doing the same
+bool is_inverter(Cell *cell)
+{
+	if (cell->type == ID($_NOT_))
+		return true;
+	return cell->type == ID($lut) && cell->getParam(ID::WIDTH).as_int() == 1
+			&& cell->getParam(ID::LUT).as_int() == 1;
+}
+
 struct LutnotPass : Pass {
 	LutnotPass() : Pass("lutnot", "absorb NOT gates into LUTs where possible") {}
 	void execute(std::vector<std::string> args, RTLIL::Design *d) override
@@ -54,7 +64,7 @@ struct LutnotPass : Pass {
 			SigPool foreign_bits;
 
 			for (auto cell : m->cells())
-			if (cell->type == ID($lut))
+			if (cell->type == ID($lut) && !is_inverter(cell))
 				lut_driver[sigmap(cell->getPort(ID::Y))] = cell;
 
 			for (auto cell : m->cells())
@@ -72,13 +82,20 @@ struct LutnotPass : Pass {
 			std::vector<Cell *> to_remove;
 
 			for (auto cell : m->cells())
-			if (cell->type == ID($_NOT_)) {
+			if (is_inverter(cell)) {
 				SigBit a_bit = sigmap(cell->getPort(ID::A));
 				SigBit y_bit = sigmap(cell->getPort(ID::Y));
 				if (foreign_bits.check(a_bit) || !lut_driver.count(a_bit))
 					continue;
 
-				log_debug("Absorbing _NOT_ cell %s driving %s\n",
+				// Another NOT of the same bit was absorbed already
+				if (replacements.count(a_bit)) {
+					m->connect(y_bit, replacements.at(a_bit));
+					to_remove.push_back(cell);
+					continue;
+				}
+
+				log_debug("Absorbing inverter %s driving %s\n",
 						  log_id(cell->name), log_signal(y_bit));
 
 				Cell *driver = lut_driver.at(a_bit);
@@ -768,6 +785,7 @@ struct LutrewriteOncePass : Pass {
 		int max_nluts = 20, max_nouterfans = 1, max_nleaves = 9;
 		bool select_root = false;
 		float w_cutoff = 1.01;
+		int threads = 0;
 		search_shared = false;
 		size_t argidx;
 		for (argidx = 1; argidx < args.size(); argidx++) {
@@ -785,11 +803,17 @@ struct LutrewriteOncePass : Pass {
 				select_root = true;
 			else if (args[argidx] == "-shared")
 				search_shared = true;
+			else if (args[argidx] == "-j" && argidx + 1 < args.size())
+				threads = atoi(args[++argidx].c_str());
 			else
 				break;
 		}
 		extra_args(args, argidx, d);
 
+		if (threads < 0)
+			log_cmd_error("Thread count can't be negative.\n");
+		thread_pool().resize(plugin_threads(threads));
+
 		bool did_something = false;
 
 		uint64_t varexplr_sum = 0;
@@ -808,7 +832,10 @@ struct LutrewriteOncePass : Pass {
 			pm.ud_lut_cuts.max_nouterfans = max_nouterfans;
 			pm.ud_lut_cuts.max_nleaves = max_nleaves;
 
-			TopoSort<Cell*> sort;
+			// Roots are visited in this order and rewritten as they go, so
+			// it's kept by name rather than by the address of the cells,
+			// which depends on what the thread pool has allocated
+			TopoSort<Cell*, RTLIL::sort_by_name_id<RTLIL::Cell>> sort;
 			for (auto cell : select_root ? m->selected_cells() : m->cells())
 			if (cell->type == ID($lut)) {
 				sort.node(cell);
@@ -834,10 +861,21 @@ struct LutrewriteOncePass : Pass {
 				int saved_delta = 0;
 				SigSpec saved_leaves;
 				SigSpec saved_outerfans;
-				int saved_nluts;
+				int saved_nluts = 0;
 				float saved_ratio = -1;
 				std::vector<int> saved_vars;
 
+				// The cuts are collected first and their variable choices
+				// explored on the thread pool, then the best one is picked
+				// in the order of enumeration
+				struct Candidate {
+					SigSpec leaves;
+					SigSpec outerfans;
+					int old_nluts;
+					ThruthTable table;
+				};
+				std::vector<Candidate> candidates;
+
 				pm.run_lut_cuts([&](){
 					auto const &st = pm.st_lut_cuts;
 					int nleaves = st.leaves.size();
@@ -848,8 +886,6 @@ struct LutrewriteOncePass : Pass {
 					if (weight < w_cutoff)
 						return;
 
-					uint64_t enum_start = PerformanceTimer::query();
-
 					ncuts++;
 
 					if (0) {
@@ -863,31 +899,38 @@ struct LutrewriteOncePass : Pass {
 
 					LutNetwork old_net;
 					old_net.import(pm.sigmap, lut_drivers, st.leaves, st.outerfans.export_all());
+					candidates.push_back(Candidate{st.leaves, st.outerfans.export_all(),
+												old_nluts, old_net.thruth_table()});
+				});
 
-					std::vector<int> new_vars;
-					int new_nluts;
-					auto table = old_net.thruth_table();
-					for (int bn = lut_min; bn <= lut_size; bn++) {
-						std::tie(new_vars, new_nluts) = explore_varchoices(table, old_nluts - 1, bn);
+				uint64_t enum_start = PerformanceTimer::query();
 
-						if (new_nluts == std::numeric_limits<int>::max())
-							continue;
+				int nbns = lut_size - lut_min + 1;
+				std::vector<std::pair<std::vector<int>, int>> explored(candidates.size() * nbns);
+				thread_pool().parallel_for(explored.size(), [&](int i) {
+					auto &cand = candidates[i / nbns];
+					explored[i] = explore_varchoices(cand.table, cand.old_nluts - 1, lut_min + i % nbns);
+				});
 
-						if (std::make_pair((float) old_nluts / (float) new_nluts, +old_nluts) > std::make_pair(saved_ratio, +saved_nluts)) {
-							saved_delta = old_nluts - new_nluts;
-							saved_leaves = st.leaves;
-							saved_vars = new_vars;
-							saved_nluts = old_nluts;
-							saved_outerfans = st.outerfans.export_all();
-							saved_ratio = (float) old_nluts / (float) new_nluts;
-						}
-					}
+				for (int i = 0; i < explored.size(); i++) {
+					auto &cand = candidates[i / nbns];
+					int old_nluts = cand.old_nluts;
+					int new_nluts = explored[i].second;
 
-					uint64_t enum_end = PerformanceTimer::query();
+					if (new_nluts == std::numeric_limits<int>::max())
+						continue;
 
-					varexplr_sum += (enum_end - enum_start);
-				});
+					if (std::make_pair((float) old_nluts / (float) new_nluts, +old_nluts) > std::make_pair(saved_ratio, +saved_nluts)) {
+						saved_delta = old_nluts - new_nluts;
+						saved_leaves = cand.leaves;
+						saved_vars = explored[i].first;
+						saved_nluts = old_nluts;
+						saved_outerfans = cand.outerfans;
+						saved_ratio = (float) old_nluts / (float) new_nluts;
+					}
+				}
 
+				varexplr_sum += PerformanceTimer::query() - enum_start;
 
 				if (saved_delta > 0) {
 					int nleaves = saved_leaves.size();
@@ -995,6 +1038,8 @@ struct LutrewritePass : Pass {
 				passdown_args += stringf("-w %s ", args[++argidx].c_str());
 			else if (args[argidx] == "-shared")
 				passdown_args += "-shared ";
+			else if (args[argidx] == "-j" && argidx + 1 < args.size())
+				passdown_args += stringf("-j %s ", args[++argidx].c_str());
 			else if (args[argidx] == "-target" && argidx + 1 < args.size())
 				lutdepth_args += stringf(" -target %s", args[++argidx].c_str());
 			else
@@ -0,0 +1,334 @@
+#ifndef __THREADS_H__
+#define __THREADS_H__
+
+#include "kernel/log.h"
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <cstdlib>
+
+// Pool of threads shared by the passes of the plugin. Each worker has a
+// queue of tasks it pushes to and pops from at the back, while idle
+// workers steal from the front of the others' queues. Threads outside the
+// pool push to a queue of their own. A thread waiting on a group of tasks
+// runs those of the group not yet started, then sleeps until the rest are
+// done, so it never picks up work unrelated to what it waits on.
+struct ThreadPool {
+	typedef std::function<void()> Task;
+
+	struct Queue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	// Queue 0 is for threads outside the pool, queue i for worker i
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+
+	std::mutex sleep_lock;
+	std::condition_variable wakeup;
+	std::atomic<int> pending;
+	std::atomic<bool> stop;
+
+	ThreadPool() : pending(0), stop(false)
+	{
+		queues.emplace_back(new Queue);
+	}
+
+	~ThreadPool()
+	{
+		resize(1);
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator= (const ThreadPool&) = delete;
+
+	// Number of threads working on tasks, the calling thread included
+	int size() const
+	{
+		return queues.size();
+	}
+
+	// Index of the calling thread within the pool, 0 for outside threads.
+	// Distinct among the threads running tasks at one time as long as
+	// only one outside thread uses the pool.
+	static int &worker_index()
+	{
+		static thread_local int index = 0;
+		return index;
+	}
+
+	// Change the number of threads. Not to be called with tasks in flight.
+	void resize(int nthreads)
+	{
+		log_assert(nthreads >= 1);
+		if (nthreads == size())
+			return;
+
+		{
+			std::lock_guard<std::mutex> guard(sleep_lock);
+			stop = true;
+		}
+		wakeup.notify_all();
+		for (auto &thread : workers)
+			thread.join();
+		workers.clear();
+		stop = false;
+
+		// With no tasks in flight, whatever is left queued are tickets of
+		// task groups already waited on, which would find nothing to run
+		for (auto &queue : queues)
+			queue->tasks.clear();
+		pending = 0;
+
+		queues.resize(1);
+		for (int i = 1; i < nthreads; i++)
+			queues.emplace_back(new Queue);
+		for (int i = 1; i < nthreads; i++)
+			workers.emplace_back([this, i]() { work(i); });
+	}
+
+	void push(Task task)
+	{
+		Queue &queue = *queues[worker_index()];
+		{
+			std::lock_guard<std::mutex> guard(queue.lock);
+			queue.tasks.push_back(std::move(task));
+		}
+		pending++;
+		if (size() > 1) {
+			std::lock_guard<std::mutex> guard(sleep_lock);
+			wakeup.notify_one();
+		}
+	}
+
+	// Run one queued task for a worker, its own latest one if there's
+	// any, otherwise the oldest one of another queue
+	bool run_one()
+	{
+		if (!pending.load())
+			return false;
+
+		int self = worker_index();
+		Task task;
+		for (int k = 0; k < size() && !task; k++) {
+			Queue &queue = *queues[(self + k) % size()];
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.tasks.empty())
+				continue;
+			if (k == 0) {
+				task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			} else {
+				task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+		}
+		if (!task)
+			return false;
+
+		pending--;
+		task();
+		return true;
+	}
+
+	void work(int index)
+	{
+		worker_index() = index;
+		while (true) {
+			// Spin a little before going to sleep, as tasks often come
+			// in quick succession
+			bool found = false;
+			for (int spin = 0; spin < 64 && !found; spin++) {
+				found = run_one();
+				if (!found)
+					std::this_thread::yield();
+			}
+			if (found)
+				continue;
+
+			std::unique_lock<std::mutex> guard(sleep_lock);
+			wakeup.wait(guard, [&]() { return stop.load() || pending.load() > 0; });
+			if (stop)
+				return;
+		}
+	}
+
+	// Tasks which can be waited on together. The tasks are queued with the
+	// group, the pool's queues only holding a ticket for each which runs
+	// the group's oldest task not yet started, if any is left by the time
+	// a worker gets to it. An exception thrown by any of the tasks is
+	// rethrown by wait(), the first one to occur if several do.
+	struct TaskGroup {
+		struct State {
+			std::mutex lock;
+			std::condition_variable finished;
+			std::deque<Task> queued;
+			int outstanding = 0;
+			std::exception_ptr error;
+
+			bool run_queued()
+			{
+				Task task;
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (queued.empty())
+						return false;
+					task = std::move(queued.front());
+					queued.pop_front();
+				}
+
+				std::exception_ptr task_error;
+				try {
+					task();
+				} catch (...) {
+					task_error = std::current_exception();
+				}
+
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					if (task_error && !error)
+						error = task_error;
+					outstanding--;
+				}
+				finished.notify_all();
+				return true;
+			}
+		};
+
+		ThreadPool &pool;
+		// Shared with the tickets, which may outlive the group
+		std::shared_ptr<State> state;
+
+		TaskGroup(ThreadPool &pool) : pool(pool), state(new State) {}
+		~TaskGroup() { log_assert(!state->outstanding); }
+
+		template<typename F>
+		void run(F f)
+		{
+			{
+				std::lock_guard<std::mutex> guard(state->lock);
+				state->queued.push_back(f);
+				state->outstanding++;
+			}
+			std::shared_ptr<State> ticket = state;
+			pool.push([ticket]() { ticket->run_queued(); });
+		}
+
+		// Sleep until `done()` holds, checking it each time a task of the
+		// group finishes. Doesn't run any tasks.
+		template<typename Pred>
+		void wait_until(Pred done)
+		{
+			std::unique_lock<std::mutex> guard(state->lock);
+			state->finished.wait(guard, [&]() { return done(); });
+		}
+
+		void wait()
+		{
+			while (state->run_queued())
+				;
+			wait_until([&]() { return !state->outstanding; });
+			if (state->error)
+				std::rethrow_exception(state->error);
+		}
+	};
+
+	// Run `body(i)` on the indices 0 to `n` - 1, claimed in chunks of
+	// `grain` consecutive indices
+	template<typename F>
+	void parallel_for(int n, F body, int grain=1)
+	{
+		int nchunks = (n + grain - 1) / grain;
+		int ntasks = std::min(nchunks, size());
+		if (ntasks <= 1) {
+			for (int i = 0; i < n; i++)
+				body(i);
+			return;
+		}
+
+		std::atomic<int> next(0);
+		auto chunks = [&]() {
+			int chunk;
+			while ((chunk = next.fetch_add(1)) < nchunks)
+			for (int i = chunk * grain; i < std::min(n, (chunk + 1) * grain); i++)
+				body(i);
+		};
+
+		TaskGroup group(*this);
+		for (int i = 1; i < ntasks; i++)
+			group.run(chunks);
+		try {
+			chunks();
+		} catch (...) {
+			// Let the other tasks finish before unwinding
+			next = nchunks;
+			try { group.wait(); } catch (...) {}
+			throw;
+		}
+		group.wait();
+	}
+
+	// Run `body(i)` on the indices 0 to `bounds.back()` - 1, split into
+	// levels ending at `bounds[l]`. A level is started once all of the
+	// previous one is done.
+	template<typename F>
+	void parallel_levels(const std::vector<int> &bounds, F body, int grain=16)
+	{
+		int start = 0;
+		for (int end : bounds) {
+			parallel_for(end - start, [&](int i) { body(start + i); }, grain);
+			start = end;
+		}
+	}
+
+	// Reduce the values `map(i)` for the indices 0 to `n` - 1 with
+	// `combine`, starting from `init`. The values are combined in chunks of
+	// `grain` and the chunk results in order of the chunks, so the outcome
+	// doesn't depend on the number of threads even if `combine` isn't
+	// associative.
+	template<typename T, typename Map, typename Combine>
+	T parallel_reduce(int n, T init, Map map, Combine combine, int grain=64)
+	{
+		int nchunks = (n + grain - 1) / grain;
+		std::vector<T> partial(nchunks, init);
+		parallel_for(nchunks, [&](int chunk) {
+			int start = chunk * grain;
+			T value = map(start);
+			for (int i = start + 1; i < std::min(n, start + grain); i++)
+				value = combine(value, map(i));
+			partial[chunk] = value;
+		});
+		T ret = init;
+		for (auto &value : partial)
+			ret = combine(ret, value);
+		return ret;
+	}
+};
+
+// The pool shared by all passes of the plugin
+inline ThreadPool &thread_pool()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+// Thread count for a pass: the one given with -j if any, otherwise the
+// one in the TOYMAP_THREADS environment variable, otherwise one
+inline int plugin_threads(int requested=0)
+{
+	if (requested > 0)
+		return requested;
+	if (const char *env = getenv("TOYMAP_THREADS"))
+	if (atoi(env) > 0)
+		return atoi(env);
+	return 1;
+}
+
+#endif
@@ -2,8 +2,13 @@
 // toymap -- Toy technology mapper of logic networks
 //
 
+// Priority cuts kept per node, and the widest cut the mapper can be
+// instantiated for (see Network::cuts())
 #define NPRIORITY_CUTS	8
-#define CUT_MAXIMUM		6
+#define CUT_MAXIMUM		10
+
+// Fewest candidate cuts of a node evaluated as a batch on several threads
+#define MIN_SPECULATED_CUTS	16
 
 #include <algorithm>
 #include <random>
@@ -11,6 +16,11 @@
 #include <vector>
 #include <map>
 #include <cstdint>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <optional>
+#include <type_traits>
 
 // Include Yosys stuff
 #include "kernel/rtlil.h"
@@ -19,6 +29,7 @@
 #include "kernel/ff.h"
 
 #include "library.h"
+#include "threads.h"
 
 template<> struct Yosys::hash_ops<uint64_t> : hash_int_ops
 {
@@ -37,7 +48,210 @@ using Yosys::log_id;
 using Yosys::ys_debug;
 using Yosys::State;
 
+// While modules are mapped concurrently, errors on the way (failed
+// assertions included) are thrown as a MappingError instead of going to
+// log_error() on the spot, which would exit from whichever thread hit them
+// with the log of the modules before still held back. They are reported
+// once the pipeline gets to emit the module.
+struct MappingError {
+	std::string text;
+};
+static std::atomic<bool> defer_errors{false};
+
+[[noreturn]] static void map_error(const char *fmt, ...) YS_ATTRIBUTE(format(printf, 1, 2));
+static void map_error(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	std::string text = Yosys::vstringf(fmt, ap);
+	va_end(ap);
+	if (defer_errors)
+		throw MappingError{text};
+	log_error("%s", text.c_str());
+}
+
+#undef log_assert
+#define log_assert(expr) do { if (!(expr)) map_error("Assert `%s' failed in %s:%d.\n", #expr, __FILE__, __LINE__); } while (0)
+
 struct AndNode;
+struct NodeArena;
+template<typename T> struct NodeData;
+
+// Truth tables of cut functions are kept in 64-bit words, a single word
+// covering up to 6 inputs. Tables over fewer inputs are replicated to fill
+// the words, i.e. they don't depend on the unused variables.
+static const u64 tt_var_masks[6] = {
+	0xaaaaaaaaaaaaaaaaull, 0xccccccccccccccccull, 0xf0f0f0f0f0f0f0f0ull,
+	0xff00ff00ff00ff00ull, 0xffff0000ffff0000ull, 0xffffffff00000000ull,
+};
+
+static constexpr int tt_nwords(int nvars)
+{
+	return nvars <= 6 ? 1 : 1 << (nvars - 6);
+}
+
+// Exchange variables i and j (i < j < 6) within a word
+static u64 tt_swap(u64 tt, int i, int j)
+{
+	int shift = (1 << j) - (1 << i);
+	u64 up = tt_var_masks[i] & ~tt_var_masks[j];
+	u64 down = tt_var_masks[j] & ~tt_var_masks[i];
+	return (tt & ~(up | down)) | ((tt & up) << shift) | ((tt & down) >> shift);
+}
+
+template<int K>
+struct TruthTable {
+	static const int NWORDS = tt_nwords(K);
+	u64 w[NWORDS];
+
+	static TruthTable var(int i)
+	{
+		TruthTable ret;
+		for (int k = 0; k < NWORDS; k++)
+			ret.w[k] = (i < 6) ? tt_var_masks[i] : ((k >> (i - 6)) & 1 ? ~(u64) 0 : 0);
+		return ret;
+	}
+
+	TruthTable operator&(const TruthTable &other) const
+	{
+		TruthTable ret;
+		for (int k = 0; k < NWORDS; k++)
+			ret.w[k] = w[k] & other.w[k];
+		return ret;
+	}
+
+	void negate()
+	{
+		for (int k = 0; k < NWORDS; k++)
+			w[k] = ~w[k];
+	}
+
+	// Exchange variables i and j, i < j
+	void swap(int i, int j)
+	{
+		if (j < 6) {
+			for (int k = 0; k < NWORDS; k++)
+				w[k] = tt_swap(w[k], i, j);
+		} else if (i < 6) {
+			int shift = 1 << i, dj = 1 << (j - 6);
+			u64 mask = tt_var_masks[i];
+			for (int k = 0; k < NWORDS; k++)
+			if (!(k & dj)) {
+				u64 a = w[k], b = w[k | dj];
+				w[k] = (a & ~mask) | ((b & ~mask) << shift);
+				w[k | dj] = (b & mask) | ((a & mask) >> shift);
+			}
+		} else {
+			int di = 1 << (i - 6), dj = 1 << (j - 6);
+			for (int k = 0; k < NWORDS; k++)
+			if ((k & di) && !(k & dj))
+				std::swap(w[k], w[k ^ di ^ dj]);
+		}
+	}
+
+	// Whether the function depends on variable i
+	bool depends_on(int i) const
+	{
+		if (i < 6) {
+			int shift = 1 << i;
+			u64 mask = tt_var_masks[i];
+			for (int k = 0; k < NWORDS; k++)
+			if (((w[k] & mask) >> shift) != (w[k] & ~mask))
+				return true;
+		} else {
+			int di = 1 << (i - 6);
+			for (int k = 0; k < NWORDS; k++)
+			if (!(k & di) && w[k] != w[k | di])
+				return true;
+		}
+		return false;
+	}
+
+	// Move the variables among the first `nvars` which the function
+	// depends on to the front, keeping their order. Returns the mask of
+	// those variables as they were before the move.
+	unsigned int shrink(int nvars)
+	{
+		unsigned int support = 0;
+		int dest = 0;
+		for (int i = 0; i < nvars; i++)
+		if (depends_on(i)) {
+			// Position `dest` holds a variable the function doesn't
+			// depend on
+			if (dest != i)
+				swap(dest, i);
+			support |= 1 << i;
+			dest++;
+		}
+		return support;
+	}
+
+	// Re-express a table over `nvars` variables in terms of a wider cut,
+	// where variable i is to land on position pos[i]. The positions must
+	// be increasing.
+	void stretch(int nvars, const int *pos)
+	{
+		for (int i = nvars - 1; i >= 0; i--)
+		if (pos[i] != i)
+			swap(i, pos[i]);
+	}
+};
+
+// Signatures of cuts are the OR of the signatures of the leaves. The
+// number of bits set is a lower bound on the number of leaves.
+static u64 sig_shift(u64 sig, int delta)
+{
+	int r = delta & 63;
+	return r ? (sig << r) | (sig >> (64 - r)) : sig;
+}
+
+static std::vector<bool> tt_bits(const u64 *tt, int nvars)
+{
+	std::vector<bool> ret;
+	for (int i = 0; i < (1 << nvars); i++)
+		ret.push_back((tt[i >> 6] >> (i & 63)) & 1);
+	return ret;
+}
+
+// Packed reference to a node along with the features of the edge leading
+// to it. Laid out as an AIGER-style literal (node ID shifted up by one,
+// complement in the lowest bit) with the lag above it, so that ordering
+// and comparison of literals are plain integer operations.
+struct Lit {
+	u64 v;
+
+	static const uint32_t CONST_ID = 0xffffffff;
+	static const int LAG_SHIFT = 33;
+
+	static Lit make(uint32_t id, int lag=0, bool negated=false)
+	{
+		log_assert(lag >= 0);
+		return Lit{((u64) lag << LAG_SHIFT) | ((u64) id << 1) | negated};
+	}
+
+	// Terminator of cut leaf lists; sorts after any other literal
+	static Lit null()				{ return Lit{~(u64) 0}; }
+	bool is_null() const			{ return v == ~(u64) 0; }
+
+	uint32_t id() const				{ return (uint32_t) (v >> 1); }
+	int lag() const					{ return (int) (v >> LAG_SHIFT); }
+	bool negated() const			{ return v & 1; }
+
+	Lit shift(int delta) const		{ return Lit{v + ((u64) (int64_t) delta << LAG_SHIFT)}; }
+
+	// One-hot signature for cut filtering. The bit position is the lag
+	// added to a hash of the ID, so shifting the lag rotates the
+	// signature (see sig_shift()).
+	u64 signature() const
+	{
+		return (u64) 1 << (((id() * 0x9e3779b1u >> 26) + lag()) & 63);
+	}
+	unsigned int hash() const		{ return Yosys::mkhash((unsigned int) v, (unsigned int) (v >> 32)); }
+
+	bool operator<(const Lit other) const	{ return v < other.v; }
+	bool operator==(const Lit other) const	{ return v == other.v; }
+	bool operator!=(const Lit other) const	{ return v != other.v; }
+};
 
 struct CoverFaninList;
 // A node in the acyclic cover of the cyclic graph
@@ -57,19 +271,24 @@ struct CoverNode {
 	bool operator==(const CoverNode other) const
 			{ return std::tie(lag, img) == std::tie(other.lag, other.img); }
 
+	Lit lit() const;
 	CoverFaninList fanins();
 };
 
+// View of a cut stored as a null-terminated array of packed literals. Iterating
+// the list unpacks the literals into CoverNodes, with `lag_inject` added
+// to the lag of each.
 struct CutList {
-	CoverNode *array;
+	const NodeArena *arena;
+	Lit *array;
 	int size;
 	int lag_inject;
 
-	CutList(CoverNode *array, int inject=0)
-		: array(array), lag_inject(inject)
+	CutList(const NodeArena &arena, Lit *array, int inject=0)
+		: arena(&arena), array(array), lag_inject(inject)
 	{
-		CoverNode *p;
-		for (p = array; (p < array + CUT_MAXIMUM) && (p->img != NULL); p++);
+		Lit *p;
+		for (p = array; !p->is_null(); p++);
 		size = p - array;
 	}
 
@@ -80,21 +299,28 @@ struct CutList {
 		return ret;
 	}
 
+	Lit lit(int i) const
+	{
+		return array[i].shift(lag_inject);
+	}
+
 	class iterator: public std::iterator<std::input_iterator_tag, CoverNode> {
-		CoverNode *p;
+		const NodeArena *arena;
+		Lit *p;
 		int lag_inject;
 	public:
-		iterator(CoverNode *p,int inject) : p(p), lag_inject(inject) {}
+		iterator(const NodeArena *arena, Lit *p, int inject)
+			: arena(arena), p(p), lag_inject(inject) {}
 		iterator& operator++() { p++; return *this; }
 		bool operator==(const iterator &other) const
 			{ return p == other.p && lag_inject == other.lag_inject; }
 		int operator-(const iterator &other) const
 			{ log_assert(other.lag_inject == lag_inject); return p - other.p; }
 		bool operator!=(const iterator &other) const { return !(*this == other); }
-		CoverNode operator*() const { return CoverNode{p->lag + lag_inject, p->img}; }
+		CoverNode operator*() const;
 	};
-	iterator begin() const { return iterator(array, lag_inject); };
-	iterator end()   const { return iterator(array + size, lag_inject); };
+	iterator begin() const { return iterator(arena, array, lag_inject); };
+	iterator end()   const { return iterator(arena, array + size, lag_inject); };
 };
 
 State invert(State state)
@@ -107,6 +333,184 @@ State invert(State state)
 	}
 }
 
+// Initial values of a chain of registers, listed from the load side. Up to
+// INLINE_SIZE values are bit-packed in place of the pointer to the heap
+// copy longer chains spill over into, so that edges can be copied and
+// compared without touching the heap while the struct stays no larger
+// than a pointer and a length. Values other than 0 and 1 are kept as
+// undefined.
+struct InitVals {
+	static const int INLINE_SIZE = 32;
+
+	int len = 0;
+	union {
+		// Bit i of the low half is set if value i is defined, of the
+		// high half if it is 1
+		u64 bits = 0;
+		std::vector<State> *spill;
+	};
+
+	InitVals() {}
+	InitVals(const InitVals &other) { *this = other; }
+	InitVals(InitVals &&other) { *this = std::move(other); }
+	~InitVals() { clear(); }
+
+	InitVals &operator=(const InitVals &other)
+	{
+		if (this == &other)
+			return *this;
+		clear();
+		len = other.len;
+		if (len > INLINE_SIZE)
+			spill = new std::vector<State>(*other.spill);
+		else
+			bits = other.bits;
+		return *this;
+	}
+
+	InitVals &operator=(InitVals &&other)
+	{
+		std::swap(len, other.len);
+		std::swap(bits, other.bits);
+		return *this;
+	}
+
+	void clear()
+	{
+		if (len > INLINE_SIZE)
+			delete spill;
+		len = 0;
+		bits = 0;
+	}
+
+	uint32_t defined() const	{ return bits; }
+	uint32_t ones() const		{ return bits >> 32; }
+
+	int size() const
+	{
+		return len;
+	}
+
+	State operator[](int i) const
+	{
+		log_assert(i >= 0 && i < len);
+		if (len > INLINE_SIZE)
+			return (*spill)[i];
+		if (!(defined() >> i & 1))
+			return State::Sx;
+		return (ones() >> i & 1) ? State::S1 : State::S0;
+	}
+
+	void set(int i, State val)
+	{
+		log_assert(i >= 0 && i < len);
+		if (len > INLINE_SIZE) {
+			(*spill)[i] = (val == State::S0 || val == State::S1) ? val : State::Sx;
+			return;
+		}
+		u64 bit = (u64) 1 << i;
+		bits &= ~(bit | bit << 32);
+		if (val == State::S0 || val == State::S1)
+			bits |= bit;
+		if (val == State::S1)
+			bits |= bit << 32;
+	}
+
+	void push_back(State val)
+	{
+		if (len == INLINE_SIZE) {
+			// Move over to the heap
+			auto heap = new std::vector<State>;
+			for (int i = 0; i < len; i++)
+				heap->push_back((*this)[i]);
+			spill = heap;
+		}
+		if (len >= INLINE_SIZE)
+			spill->push_back(State::Sx);
+		len++;
+		set(len - 1, val);
+	}
+
+	void pop_back()
+	{
+		log_assert(len > 0);
+		if (len > INLINE_SIZE) {
+			spill->pop_back();
+			if (--len == INLINE_SIZE) {
+				// Move back inline
+				std::vector<State> *heap = spill;
+				bits = 0;
+				for (int i = 0; i < len; i++)
+					set(i, (*heap)[i]);
+				delete heap;
+			}
+			return;
+		}
+		set(len - 1, State::Sx);
+		len--;
+	}
+
+	void append(const InitVals &other)
+	{
+		if (!other.len)
+			return;
+		if (len + other.len <= INLINE_SIZE) {
+			bits |= (u64) other.defined() << len | (u64) other.ones() << (32 + len);
+			len += other.len;
+			return;
+		}
+		for (int i = 0; i < other.len; i++)
+			push_back(other[i]);
+	}
+
+	// Swap zeroes for ones and vice versa
+	void invert()
+	{
+		if (len > INLINE_SIZE) {
+			for (auto &val : *spill)
+				val = ::invert(val);
+		} else {
+			bits ^= (u64) defined() << 32;
+		}
+	}
+
+	bool undef() const
+	{
+		if (len > INLINE_SIZE) {
+			for (auto val : *spill)
+				if (val != State::Sx)
+					return false;
+			return true;
+		}
+		return !defined();
+	}
+
+	void assign_undef(int new_len)
+	{
+		clear();
+		len = new_len;
+		if (len > INLINE_SIZE)
+			spill = new std::vector<State>(len, State::Sx);
+	}
+
+	bool operator<(const InitVals &other) const
+	{
+		if (len != other.len)
+			return len < other.len;
+		if (len > INLINE_SIZE)
+			return *spill < *other.spill;
+		return std::make_pair(defined(), ones()) < std::make_pair(other.defined(), other.ones());
+	}
+	bool operator==(const InitVals &other) const
+	{
+		if (len != other.len)
+			return false;
+		if (len > INLINE_SIZE)
+			return *spill == *other.spill;
+		return bits == other.bits;
+	}
+};
+
 struct NodeInput {
 	NodeInput() {}
 	NodeInput(CoverNode node, bool negated)
@@ -114,13 +518,14 @@ struct NodeInput {
 		set_node(node.img);
 		feat.lag = node.lag;
 		feat.negated = negated;
+		feat.fixup_initvals();
 	}
 
 	AndNode *node = NULL;
 	struct EdgeFeatures {
 		bool negated = false;
 		int lag = 0;
-		std::vector<State> initvals;
+		InitVals initvals;
 
 		bool empty() const
 		{
@@ -134,18 +539,16 @@ struct NodeInput {
 		{
 			if (other.negated) {
 				negated ^= true;
-				for (int i = 0; i < lag; i++)
-					initvals[i] = invert(initvals[i]);
+				initvals.invert();
 			}
 
-			initvals.insert(initvals.end(), other.initvals.begin(),
-							other.initvals.end());
+			initvals.append(other.initvals);
 			lag += other.lag;
 		}
 
 		bool crop_const_lag()
 		{
-			log_assert((int) initvals.size() == lag);
+			log_assert(initvals.size() == lag);
 			int i;
 			for (i = initvals.size() - 1; i >= 0; i--)
 			if (initvals[i] == State::Sx || 
@@ -154,7 +557,7 @@ struct NodeInput {
 			else
 				break;
 			if (i < lag - 1) {
-				lag = (int) initvals.size();
+				lag = initvals.size();
 				return true;	
 			} else {
 				return false;
@@ -163,15 +566,12 @@ struct NodeInput {
 
 		bool initvals_undef()
 		{
-			for (auto bit : initvals)
-			if (bit != RTLIL::State::Sx)
-				return false;
-			return true;
+			return initvals.undef();
 		}
 
 		void fixup_initvals()
 		{
-			initvals = std::vector<RTLIL::State>(lag, RTLIL::State::Sx);
+			initvals.assign_undef(lag);
 		}
 
 		bool operator<(const EdgeFeatures &other) const
@@ -195,9 +595,10 @@ struct NodeInput {
 
 	bool is_const() { return !node && feat.lag == 0; }
 	bool eval()		{ log_assert(is_const()); return feat.negated; }
-	u64 weval();
+	u64 weval(NodeData<u64> &wevals);
 
 	CoverNode cover_node() { log_assert(node); return CoverNode{feat.lag, node}; }
+	Lit lit() const;
 
 	std::string describe(int descend);
 
@@ -206,114 +607,44 @@ struct NodeInput {
 	bool eval_conditionally(const NodeInput &other);
 	bool assume(const NodeInput &other);
 
-	std::vector<bool> truth_table(CutList cutlist);
 
 	bool operator<(const NodeInput &other) const
 	{
-		if (!node != !other.node)
-			return !node < !other.node;
-		return std::tie(feat, node) < std::tie(other.feat, other.node);
+		Lit a = lit(), b = other.lit();
+		return std::tie(a, feat.initvals) < std::tie(b, other.feat.initvals);
 	}
 	bool operator==(const NodeInput &other) const
-			{ return std::tie(feat, node) == std::tie(other.feat, other.node); }
+	{
+		Lit a = lit(), b = other.lit();
+		return std::tie(a, feat.initvals) == std::tie(b, other.feat.initvals);
+	}
 
 	unsigned int hash() const
 	{
-		log_assert(!feat.lag); // TODO
-		return (uintptr_t) node + feat.negated;
+		return lit().hash();
 	}
 };
 
 struct AndNode {
+	uint32_t id = 0; // index into the owning network's arena
 	bool pi = false;
 	bool po = false;
 
 	NodeInput ins[2];
 
-	RTLIL::IdString label;
 	AndNode() {};
 
-	// Scratch area for algorithms
-	bool visited;
-	RTLIL::SigBit yw = {};
-	union {
-		int refs;
-		struct {
-			CoverNode cut[CUT_MAXIMUM];	
-			double area_flow;
-			int edge_flow;
-			int map_fanouts;
-		};
-		bool has_foreign_cell_users;
-		int timedelta;
-		struct {
-			AndNode *replacement;
-			bool feeds_inverter;
-			int andtree_counter;
-		};
-	};
-	int fanouts;
-	int depth_limit;
-	int fid; // frontier index
-	int depth;
-	u64 weval;
-
-	void propagate_weval()
-	{
-		if (pi)
-			return;
-		weval = ins[0].weval() & ins[1].weval();
-	}
-
-	void apply_replacements()
-	{
-		for (int i = 0; i < 2; i++)
-		while (ins[i].node && ins[i].node->replacement) {
-			log_assert(ins[i].node != ins[i].node->replacement);
-			ins[i].node = ins[i].node->replacement;
-		}
-	}
-
-	std::vector<bool> truth_table()
-	{
-		return truth_table(CutList{cut, 0});
-	}
-
-	std::vector<bool> truth_table(CutList cutlist, bool negate=false)
-	{
-		for (auto it = cutlist.begin(); it != cutlist.end(); ++it)
-		if (*it == this) {
-			int index = it - cutlist.begin();
-			std::vector<bool> ret;
-			for (int i = 0; i < (1 << cutlist.size); i++)
-				ret.push_back((((i >> index) & 1) ^ negate) != 0);
-			return ret;
-		}
-
-		log_assert(!pi && "spilled cut");
-		std::vector<bool> a = ins[0].truth_table(cutlist);
-		std::vector<bool> b = ins[1].truth_table(cutlist);
-		log_assert(a.size() == 1 << cutlist.size && b.size() == 1 << cutlist.size);
-		std::vector<bool> ret;
-		for (int i = 0; i < (1 << cutlist.size); i++)
-			ret.push_back((a[i] && b[i]) ^ negate);
-		return ret;
-	}
-
-	void combine_label(RTLIL::IdString other_label)
-	{
-		if (other_label.empty())
-			return;
-
-		if (label.empty()) {
-			label = other_label;
-			return;
-		}
-
-		if (std::make_pair(other_label.isPublic(), -other_label.size())
-					> std::make_pair(label.isPublic(), -label.size()))
-			label = other_label;
-	}
+	// Mapping state. Anything that is only needed by a single pass, or
+	// only on the way in and out of Yosys, is kept off the node in
+	// NodeData arrays.
+	uint32_t visit_epoch = 0; // see Network::begin_traversal()
+	double area_flow = 0;
+	int edge_flow = 0;
+	int map_fanouts = 0;
+	int fanouts = 0;
+	int depth_limit = 0;
+	int fid = 0; // frontier index
+	int depth = 0;
 
 	bool expand();
 
@@ -371,6 +702,16 @@ CoverFaninList CoverNode::fanins()
 	return CoverFaninList{ *this };
 }
 
+Lit CoverNode::lit() const
+{
+	return Lit::make(img->id, lag);
+}
+
+Lit NodeInput::lit() const
+{
+	return Lit::make(node ? node->id : Lit::CONST_ID, feat.lag, feat.negated);
+}
+
 #if 0
 std::string NodeInput::describe(int descend)
 {
@@ -378,8 +719,8 @@ std::string NodeInput::describe(int descend)
 	if (feat.negated) ret += "~";
 	if (feat.lag) {
 		ret += "[";
-		for (auto it = feat.initvals.rbegin(); it != feat.initvals.rend(); it++)
-		switch (*it) {
+		for (int i = feat.initvals.size() - 1; i >= 0; i--)
+		switch (feat.initvals[i]) {
 		case State::S1:
 			ret += "1";
 			break;
@@ -407,28 +748,6 @@ std::string NodeInput::describe(int descend)
 }
 #endif
 
-std::vector<bool> NodeInput::truth_table(CutList cutlist)
-{
-	log_assert(feat.initvals_undef());
-
-	if (!node) {
-		return std::vector<bool>(1 << cutlist.size, feat.negated);
-	} else {
-		return node->truth_table(cutlist.inject_lag(-feat.lag), feat.negated);
-	}
-}
-
-u64 NodeInput::weval()
-{
-	if (!node) {
-		log_assert(is_const());
-		return eval() ? ~(u64) 0 : 0;
-	} else {
-		log_assert(!feat.lag);
-		return feat.negated ? ~node->weval : node->weval;
-	}
-}
-
 bool NodeInput::expand()
 {
 	if (is_const())
@@ -507,82 +826,691 @@ bool AndNode::expand()
 	return did;
 }
 
-struct Network {
-	std::vector<AndNode*> nodes;
-	bool impure_module = false;
-	int frontier_size = 0;
 
-	Network() {}
-	~Network() {
-		for (auto node : nodes)
-			delete node;
+// Storage for the nodes of a network. Nodes are carved out of fixed-size
+// chunks so that they sit close in memory and pointers to them stay valid
+// as the network grows. Each node is given a 32-bit ID which doubles as
+// its index into the arena and stays with the node until it is released.
+// Released IDs are recycled lowest-first to keep the ID space dense.
+struct NodeArena {
+	static const int CHUNK_BITS = 12;
+	static const uint32_t CHUNK_SIZE = 1 << CHUNK_BITS;
+
+	std::vector<AndNode*> chunks;
+	std::vector<uint32_t> free_ids; // sorted in descending order
+	uint32_t nallocated = 0;
+
+	NodeArena() {}
+	~NodeArena() { clear(); }
+
+	NodeArena(const NodeArena&) = delete;
+	NodeArena& operator= (const NodeArena&) = delete;
+	NodeArena(NodeArena&& other)
+	{
+		*this = std::move(other);
+	}
+	NodeArena& operator= (NodeArena&& other)
+	{
+		clear();
+		chunks.swap(other.chunks);
+		free_ids.swap(other.free_ids);
+		std::swap(nallocated, other.nallocated);
+		return *this;
 	}
 
-	Network (const Network&) = delete;
-	Network& operator= (const Network&) = delete;
-	Network(Network&& other) {
+	AndNode *operator[](uint32_t id) const
+	{
+		return &chunks[id >> CHUNK_BITS][id & (CHUNK_SIZE - 1)];
+	}
 
-		impure_module = other.impure_module;
-		frontier_size = other.frontier_size;
+	// One past the highest ID ever handed out; suitable for sizing
+	// arrays indexed by node ID
+	uint32_t id_bound() const
+	{
+		return nallocated;
 	}
 
-	void yosys_import(RTLIL::Module *m, bool import_ff=false)
+	int nlive() const
 	{
-		Yosys::SigMap sigmap(m);
+		return nallocated - free_ids.size();
+	}
 
-		Yosys::dict<RTLIL::SigBit, AndNode*> wire_nodes;
+	AndNode *alloc()
+	{
+		uint32_t id;
+		if (!free_ids.empty()) {
+			id = free_ids.back();
+			free_ids.pop_back();
+		} else {
+			if (nallocated == chunks.size() * CHUNK_SIZE)
+				chunks.push_back(new AndNode[CHUNK_SIZE]);
+			id = nallocated++;
+		}
 
-		AndNode *node;
-		wire_nodes[RTLIL::State::S0] = node = new AndNode();
-		node->has_foreign_cell_users = false;
-		node->visited = false;
-		nodes.push_back(node);
-		node->ins[0].set_const(0);
-		node->ins[1].set_const(0);
-		wire_nodes[RTLIL::State::S1] = node = new AndNode();
-		node->has_foreign_cell_users = false;
-		node->visited = false;
-		nodes.push_back(node);
-		node->ins[0].set_const(1);
-		node->ins[1].set_const(1);
+		AndNode *node = (*this)[id];
+		*node = AndNode();
+		node->id = id;
+		return node;
+	}
 
-		// uh oh
-		wire_nodes[RTLIL::State::Sx] = node = new AndNode();
-		node->has_foreign_cell_users = false;
-		node->visited = false;
-		nodes.push_back(node);
-		node->ins[0].set_const(0);
-		node->ins[1].set_const(0);
+	// Release a batch of nodes for reuse. No memory is returned to the
+	// system until the arena is cleared.
+	void release(const std::vector<AndNode*> &dead)
+	{
+		for (auto node : dead) {
+			free_ids.push_back(node->id);
+			*node = AndNode();
+		}
+		std::sort(free_ids.begin(), free_ids.end(), std::greater<uint32_t>());
+	}
 
-		// Generate nodes for all wires, these will be pruned
-		// based on usage later
-		for (auto wire : m->wires())
-		for (int i = 0; i < wire->width; i++) {
-			RTLIL::SigBit bit(wire, i);
-			RTLIL::SigBit mapped = sigmap(bit);
+	// Make this a copy of another arena. Node IDs are preserved and the
+	// pointers between nodes are redirected into this arena.
+	void copy_from(const NodeArena &other)
+	{
+		clear();
+		for (auto chunk : other.chunks) {
+			chunks.push_back(new AndNode[CHUNK_SIZE]);
+			std::copy(chunk, chunk + CHUNK_SIZE, chunks.back());
+		}
+		free_ids = other.free_ids;
+		nallocated = other.nallocated;
 
-			if (!mapped.wire)
-				continue;
+		for (uint32_t id = 0; id < nallocated; id++)
+		for (auto &in : (*this)[id]->ins)
+		if (in.node)
+			in.node = (*this)[in.node->id];
+	}
 
-			if (wire_nodes.count(mapped)) {
-				node = wire_nodes.at(mapped);
-			} else {
-				wire_nodes[mapped] = node = new AndNode();
-				node->has_foreign_cell_users = false;
-				node->visited = false;
-				node->yw = mapped;
-				nodes.push_back(node);
-			}
+	void clear()
+	{
+		for (auto chunk : chunks)
+			delete[] chunk;
+		chunks.clear();
+		free_ids.clear();
+		nallocated = 0;
+	}
+};
 
-			if (wire->port_input)
-				node->pi = true;
-			if (wire->port_output)
-				node->has_foreign_cell_users = true;
+// Array of per-node values indexed by node ID. Passes keep their scratch
+// state in these instead of on the nodes. The array grows as needed when
+// it's indexed with nodes allocated after it was created.
+template<typename T>
+struct NodeData {
+	std::vector<T> data;
+	T init;
+
+	NodeData(T init=T())
+		: init(init) {}
+	NodeData(const NodeArena &arena, T init=T())
+		: data(arena.id_bound(), init), init(init) {}
+
+	T &operator[](const AndNode *node)
+	{
+		if (node->id >= data.size())
+			data.resize(node->id + 1, init);
+		return data[node->id];
+	}
+};
+
+// Structural hash of the AND nodes of a network, keyed by the packed
+// literals of the two inputs in either order. Open addressing with linear
+// probing over node IDs. Entries aren't updated as nodes are rewired, a
+// lookup only returns a node whose inputs still match; the table is
+// rebuilt whenever the network is cleaned.
+struct StrashTable {
+	std::vector<uint32_t> slots; // node ID plus one, or zero for empty
+	int nused = 0;
+
+	static unsigned int hash(const NodeInput &a, const NodeInput &b)
+	{
+		Lit la = a.lit(), lb = b.lit();
+		if (lb < la)
+			std::swap(la, lb);
+		return Yosys::mkhash(la.hash(), lb.hash());
+	}
+
+	static bool matches(const AndNode *node, const NodeInput &a, const NodeInput &b)
+	{
+		return !node->pi && !node->po &&
+			((node->ins[0] == a && node->ins[1] == b) ||
+			 (node->ins[0] == b && node->ins[1] == a));
+	}
+
+	AndNode *lookup(const NodeArena &arena, const NodeInput &a, const NodeInput &b) const
+	{
+		if (slots.empty())
+			return nullptr;
+		size_t mask = slots.size() - 1;
+		for (size_t i = hash(a, b) & mask; slots[i]; i = (i + 1) & mask) {
+			AndNode *node = arena[slots[i] - 1];
+			if (matches(node, a, b))
+				return node;
+		}
+		return nullptr;
+	}
+
+	void insert(const NodeArena &arena, AndNode *node)
+	{
+		if (2 * (nused + 1) > (int) slots.size())
+			grow(arena);
+		size_t mask = slots.size() - 1;
+		size_t i = hash(node->ins[0], node->ins[1]) & mask;
+		while (slots[i])
+			i = (i + 1) & mask;
+		slots[i] = node->id + 1;
+		nused++;
+	}
+
+	void grow(const NodeArena &arena)
+	{
+		std::vector<uint32_t> old;
+		old.swap(slots);
+		slots.assign(std::max<size_t>(64, 2 * old.size()), 0);
+		nused = 0;
+		for (auto id : old)
+		if (id)
+			insert(arena, arena[id - 1]);
+	}
+
+	void clear()
+	{
+		slots.clear();
+		nused = 0;
+	}
+};
+
+u64 NodeInput::weval(NodeData<u64> &wevals)
+{
+	if (!node) {
+		log_assert(is_const());
+		return eval() ? ~(u64) 0 : 0;
+	} else {
+		log_assert(!feat.lag);
+		return feat.negated ? ~wevals[node] : wevals[node];
+	}
+}
+
+CoverNode CutList::iterator::operator*() const
+{
+	Lit lit = p->shift(lag_inject);
+	return CoverNode{lit.lag(), (*arena)[lit.id()]};
+}
+
+// Priority cuts of a node. Leaves are stored packed into 32 bits (see
+// Network::pack_leaf()) with the leaf count alongside instead of a terminator.
+template<int K, int NCuts>
+struct CutSet {
+	struct PriorityCut {
+		u64 sig;
+		TruthTable<K> tt;
+		uint32_t leaves[K];
+		uint8_t len;
+	} ps[NCuts];
+	uint32_t mark; // ID of the node the set was last filled for
+	int changed; // last pass the set changed in (see CutStore)
+	uint8_t ps_len;
+
+	// Whether both sets hold the same cuts, in whatever order
+	bool same_cuts(const CutSet &other) const
+	{
+		if (ps_len != other.ps_len)
+			return false;
+		for (int i = 0; i < ps_len; i++) {
+			bool found = false;
+			for (int j = 0; j < ps_len && !found; j++)
+				found = ps[i].len == other.ps[j].len
+						&& std::equal(ps[i].leaves, ps[i].leaves + ps[i].len, other.ps[j].leaves);
+			if (!found)
+				return false;
+		}
+		return true;
+	}
+};
+
+// Cut sets kept across the cuts<> passes of one depth_cuts() run, so that
+// passes can re-rank the sets of nodes whose fanin sets didn't change
+// instead of enumerating them anew
+struct CutStoreBase {
+	int pass = 0;
+	virtual ~CutStoreBase() {}
+};
+
+template<int K, int NCuts>
+struct CutStore : CutStoreBase {
+	std::vector<CutSet<K, NCuts>> sets;
+};
+
+// The best few cuts seen so far on a node, ordered by an evaluation and a
+// hash of the cut as a tie-breaker, each with the index of the slot the
+// cut is stored in. Kept as a sorted array of fixed capacity so nothing is
+// allocated as candidates come and go.
+template<typename Eval, int Capacity>
+struct Leaderboard {
+	struct Entry {
+		Eval eval;
+		int hash;
+		int slot;
+
+		bool operator<(const Entry &other) const
+		{
+			if (eval < other.eval)
+				return true;
+			if (other.eval < eval)
+				return false;
+			return hash < other.hash;
+		}
+	};
+
+	// Entries are constructed on insertion
+	union { Entry entries[Capacity]; };
+	int len = 0;
+
+	Leaderboard() {}
+
+	int size() const			{ return len; }
+	bool empty() const			{ return !len; }
+	const Entry &best() const	{ log_assert(len); return entries[0]; }
+	const Entry &worst() const	{ log_assert(len); return entries[len - 1]; }
+	void pop_worst()			{ log_assert(len); len--; }
+	Entry &operator[](int i)	{ return entries[i]; }
+
+	void remove(int i)
+	{
+		log_assert(i < len);
+		for (len--; i < len; i++)
+			new (&entries[i]) Entry(entries[i + 1]);
+	}
+
+	// Whether there's an entry which compares equal
+	bool contains(const Entry &entry) const
+	{
+		for (int i = 0; i < len && !(entry < entries[i]); i++)
+		if (!(entries[i] < entry))
+			return true;
+		return false;
+	}
+
+	void insert(const Entry &entry)
+	{
+		log_assert(len < Capacity);
+		int i = len++;
+		for (; i > 0 && entry < entries[i - 1]; i--)
+			new (&entries[i]) Entry(entries[i - 1]);
+		new (&entries[i]) Entry(entry);
+	}
+};
+
+// The passes run by Network::depth_cuts() after the initial depth-optimal
+// one
+struct CutSchedule {
+	const char *name = "default";
+	// Re-run depth selection with late rejection
+	bool redo_depth = true;
+	int area_flow_rounds = 1;
+	int exact_area_rounds = 2;
+	// Levels by which the mapping may exceed the optimal depth
+	int depth_slack = 0;
+};
+
+struct Network {
+	NodeArena arena;
+	std::vector<AndNode*> nodes;
+	StrashTable strash;
+	bool impure_module = false;
+	int frontier_size = 0;
+
+	// A node counts as visited if its `visit_epoch` matches this
+	uint32_t epoch = 0;
+
+	// Average number of priority cuts to keep per node, or zero for
+	// keeping the full NPRIORITY_CUTS everywhere
+	int cut_budget = 0;
+
+	// Keep cut sets across the passes of depth_cuts()
+	bool reuse_cuts = false;
+
+	// Map networks of more than twice this many nodes by windows of about
+	// this size (see partitioned_cuts()), or not at all if zero
+	int partition_size = 0;
+
+	// For a window of a larger network, the depths at which its PIs arrive
+	// and the limits on the depths of its POs. Empty otherwise.
+	NodeData<int> arrivals;
+	NodeData<int> po_limits;
+	std::unique_ptr<CutStoreBase> cut_store;
+
+	// Whether the passes may use several threads of thread_pool(), and how
+	// many there are. With more than one, the nodes are also kept grouped by level in `level_order`, with level l
+	// ending at `level_bounds[l]`, and assigned frontier slots for that
+	// order in `level_slots`.
+	int threads = 1;
+	std::vector<AndNode*> level_order;
+	std::vector<int> level_bounds;
+	NodeData<int> level_slots;
+	int level_frontier_size = 0;
+
+	// Scratch stack for walk_mffc()
+	std::vector<AndNode*> mffc_stack;
+
+	// Wire names and bits associated with nodes
+	NodeData<std::string> labels;
+	NodeData<RTLIL::SigBit> ywires;
+
+	// The cut selected on each node, indexed by node ID. Entries are sized
+	// after the width the cuts are being computed for: room for
+	// `cut_width` leaves plus a terminator, and a truth table of
+	// `tt_words` words.
+	int cut_width = 0;
+	int tt_words = 1;
+	std::vector<Lit> cut_leaves;
+	std::vector<u64> cut_tts;
+
+	// Whether leaves a cut's function doesn't depend on are dropped. Not
+	// so if any edge carries initial values, as the leaves then have to
+	// bound the cone check_cut_initvals() walks.
+	bool drop_vacuous = true;
+
+	// Output of the passes is held in `log_buffer` if that's set, so that
+	// networks can be worked on concurrently with their output still
+	// coming out in a fixed order
+	struct LogEntry {
+		bool warning;
+		std::string text;
+	};
+	std::vector<LogEntry> *log_buffer = nullptr;
+
+	void nlog(const char *fmt, ...) YS_ATTRIBUTE(format(printf, 2, 3))
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		std::string text = Yosys::vstringf(fmt, ap);
+		va_end(ap);
+		if (log_buffer)
+			log_buffer->push_back({false, text});
+		else
+			log("%s", text.c_str());
+	}
+
+	void nlog_warning(const char *fmt, ...) YS_ATTRIBUTE(format(printf, 2, 3))
+	{
+		va_list ap;
+		va_start(ap, fmt);
+		std::string text = Yosys::vstringf(fmt, ap);
+		va_end(ap);
+		if (log_buffer)
+			log_buffer->push_back({true, text});
+		else
+			log_warning("%s", text.c_str());
+	}
+
+	Network() {}
+
+	Network (const Network&) = delete;
+	Network& operator= (const Network&) = delete;
+	Network(Network&& other) {
+		*this = std::move(other);
+	}
+	Network& operator= (Network&& other) {
+		arena = std::move(other.arena);
+		nodes.swap(other.nodes);
+		strash = std::move(other.strash);
+		labels.data.swap(other.labels.data);
+		ywires.data.swap(other.ywires.data);
+		cut_width = other.cut_width;
+		tt_words = other.tt_words;
+		cut_leaves.swap(other.cut_leaves);
+		cut_tts.swap(other.cut_tts);
+		drop_vacuous = other.drop_vacuous;
+		impure_module = other.impure_module;
+		frontier_size = other.frontier_size;
+		epoch = other.epoch;
+		cut_budget = other.cut_budget;
+		reuse_cuts = other.reuse_cuts;
+		partition_size = other.partition_size;
+		arrivals.data.swap(other.arrivals.data);
+		po_limits.data.swap(other.po_limits.data);
+		cut_store = std::move(other.cut_store);
+		threads = other.threads;
+		level_order.swap(other.level_order);
+		level_bounds.swap(other.level_bounds);
+		level_slots.data.swap(other.level_slots.data);
+		level_frontier_size = other.level_frontier_size;
+		log_buffer = other.log_buffer;
+		return *this;
+	}
+
+	// Deep copy of the network, e.g. for mapping it more than once. The
+	// cut store of a running depth_cuts() isn't carried over.
+	Network copy() const
+	{
+		Network ret;
+		ret.arena.copy_from(arena);
+		for (auto node : nodes)
+			ret.nodes.push_back(ret.arena[node->id]);
+		ret.strash = strash;
+		ret.labels = labels;
+		ret.ywires = ywires;
+		ret.cut_width = cut_width;
+		ret.tt_words = tt_words;
+		ret.cut_leaves = cut_leaves;
+		ret.cut_tts = cut_tts;
+		ret.drop_vacuous = drop_vacuous;
+		ret.impure_module = impure_module;
+		ret.frontier_size = frontier_size;
+		ret.epoch = epoch;
+		ret.cut_budget = cut_budget;
+		ret.reuse_cuts = reuse_cuts;
+		ret.partition_size = partition_size;
+		ret.arrivals = arrivals;
+		ret.po_limits = po_limits;
+		ret.threads = threads;
+		ret.log_buffer = log_buffer;
+		return ret;
+	}
+
+	// Point the wire bits of the network at the same-named wires of `m`,
+	// for a network which is to be exported into a copy of the module it
+	// was imported from
+	void rebind_wires(RTLIL::Module *m)
+	{
+		for (auto &bit : ywires.data)
+		if (bit.wire) {
+			RTLIL::Wire *wire = m->wire(bit.wire->name);
+			log_assert(wire);
+			bit = RTLIL::SigBit(wire, bit.offset);
+		}
+	}
+
+	// Start a new traversal; all nodes become unvisited
+	void begin_traversal()
+	{
+		if (++epoch == 0) {
+			for (uint32_t id = 0; id < arena.id_bound(); id++)
+				arena[id]->visit_epoch = 0;
+			epoch = 1;
+		}
+	}
+
+	bool visited(const AndNode *node) const
+	{
+		return node->visit_epoch == epoch;
+	}
+
+	void visit(AndNode *node)
+	{
+		node->visit_epoch = epoch;
+	}
+
+	AndNode *add_node()
+	{
+		AndNode *node = arena.alloc();
+		nodes.push_back(node);
+		return node;
+	}
+
+	// AND of two inputs; an existing node of the same structure if there's
+	// one, otherwise a new node, in which case `created` is set
+	AndNode *and_node(const NodeInput &a, const NodeInput &b, bool *created=nullptr)
+	{
+		if (created)
+			*created = false;
+		if (AndNode *node = strash.lookup(arena, a, b))
+			return node;
+		if (created)
+			*created = true;
+		AndNode *node = add_node();
+		node->ins[0] = a;
+		node->ins[1] = b;
+		strash.insert(arena, node);
+		return node;
+	}
+
+	// Re-enter the AND nodes into the structural hash, the first one of
+	// any duplicates staying the representative
+	void rehash()
+	{
+		strash.clear();
+		for (auto node : nodes)
+		if (!node->pi && !node->po && !strash.lookup(arena, node->ins[0], node->ins[1]))
+			strash.insert(arena, node);
+	}
+
+	// Make room for the cuts of all nodes allocated so far. Growing the
+	// storage invalidates any CutList views into it.
+	void reserve_cuts()
+	{
+		size_t n = arena.id_bound();
+		if (n * (cut_width + 1) > cut_leaves.size()) {
+			cut_leaves.resize(n * (cut_width + 1), Lit::null());
+			cut_tts.resize(n * tt_words, 0);
+		}
+	}
+
+	Lit *selected_cut(AndNode *node)
+	{
+		size_t stride = cut_width + 1;
+		if ((node->id + 1) * stride > cut_leaves.size())
+			reserve_cuts();
+		return &cut_leaves[node->id * stride];
+	}
+
+	// Function of the node in terms of the leaves of its selected cut
+	u64 *selected_tt(AndNode *node)
+	{
+		selected_cut(node);
+		return &cut_tts[node->id * tt_words];
+	}
+
+	// Re-layout the selected cut storage for cuts of up to `width` leaves,
+	// carrying over those selected cuts which fit
+	void set_cut_width(int width)
+	{
+		if (width == cut_width) {
+			reserve_cuts();
+			return;
+		}
+
+		std::vector<Lit> old_leaves;
+		std::vector<u64> old_tts;
+		old_leaves.swap(cut_leaves);
+		old_tts.swap(cut_tts);
+		size_t old_stride = cut_width + 1;
+		int old_words = tt_words;
+
+		cut_width = width;
+		tt_words = tt_nwords(width);
+		reserve_cuts();
+		for (auto node : nodes) {
+			if ((node->id + 1) * old_stride > old_leaves.size())
+				continue;
+			Lit *old_cut = &old_leaves[node->id * old_stride];
+			int len = 0;
+			while (!old_cut[len].is_null())
+				len++;
+			if (len > width)
+				continue;
+			std::copy(old_cut, old_cut + len + 1, selected_cut(node));
+			// Tables are replicated over the unused variables, so this
+			// works for both narrowing and widening
+			for (int k = 0; k < tt_words; k++)
+				selected_tt(node)[k] = old_tts[node->id * old_words + k % old_words];
+		}
+	}
+
+	// The cut currently selected on a node
+	CutList cutlist(AndNode *node, int inject=0)
+	{
+		return CutList(arena, selected_cut(node), inject);
+	}
+
+	void combine_label(AndNode *node, const std::string &other_label)
+	{
+		std::string &label = labels[node];
+
+		if (other_label.empty())
+			return;
+
+		if (label.empty()) {
+			label = other_label;
+			return;
+		}
+
+		if (std::make_pair(other_label[0] == '\\', -(int) other_label.size())
+					> std::make_pair(label[0] == '\\', -(int) label.size()))
+			label = other_label;
+	}
+
+	void yosys_import(RTLIL::Module *m, bool import_ff=false)
+	{
+		Yosys::SigMap sigmap(m);
+
+		Yosys::dict<RTLIL::SigBit, AndNode*> wire_nodes;
+		NodeData<char> has_foreign_cell_users(false);
+
+		// Nodes get marked visited as they are found to be driving
+		// an imported cell
+		begin_traversal();
+
+		AndNode *node;
+		wire_nodes[RTLIL::State::S0] = node = add_node();
+		node->ins[0].set_const(0);
+		node->ins[1].set_const(0);
+		wire_nodes[RTLIL::State::S1] = node = add_node();
+		node->ins[0].set_const(1);
+		node->ins[1].set_const(1);
+
+		// uh oh
+		wire_nodes[RTLIL::State::Sx] = node = add_node();
+		node->ins[0].set_const(0);
+		node->ins[1].set_const(0);
+
+		// Generate nodes for all wires, these will be pruned
+		// based on usage later
+		for (auto wire : m->wires())
+		for (int i = 0; i < wire->width; i++) {
+			RTLIL::SigBit bit(wire, i);
+			RTLIL::SigBit mapped = sigmap(bit);
+
+			if (!mapped.wire)
+				continue;
+
+			if (wire_nodes.count(mapped)) {
+				node = wire_nodes.at(mapped);
+			} else {
+				wire_nodes[mapped] = node = add_node();
+				ywires[node] = mapped;
+			}
+
+			if (wire->port_input)
+				node->pi = true;
+			if (wire->port_output)
+				has_foreign_cell_users[node] = true;
 
 			if (bit.wire->width == 1)
-				node->combine_label(bit.wire->name);
+				combine_label(node, bit.wire->name.str());
 			else
-				node->combine_label(Yosys::stringf("%s[%d]",
+				combine_label(node, Yosys::stringf("%s[%d]",
 						bit.wire->name.c_str(), bit.offset));
 		}
 
@@ -597,8 +1525,8 @@ struct Network {
 		for (auto &conn : cell->connections_) {
 			for (auto bit : sigmap(conn.second))
 			if (bit.wire) {
-				wire_nodes.at(bit)->has_foreign_cell_users = true;
-				log_assert(wire_nodes.at(bit)->yw.wire);
+				has_foreign_cell_users[wire_nodes.at(bit)] = true;
+				log_assert(ywires[wire_nodes.at(bit)].wire);
 			}
 		}
 
@@ -607,6 +1535,7 @@ struct Network {
 			initvals.set(&sigmap, m);
 
 		std::vector<RTLIL::Cell *> imported_cells;
+		Yosys::dict<RTLIL::SigBit, RTLIL::Cell *> gate_drivers;
 
 		for (auto cell : m->cells()) {
 			if (cell->type == ID($ff) && import_ff) {
@@ -615,9 +1544,9 @@ struct Network {
 					AndNode *node = wire_nodes.at(q);
 					NodeInput *ins = node->ins;
 
-					if (node->has_foreign_cell_users) {
+					if (has_foreign_cell_users[node]) {
 						node->po = true;
-						log_assert(node->yw.wire);
+						log_assert(ywires[node].wire);
 					}
 
 					ins[0].set_node(wire_nodes.at(sigmap(cell->getPort(Yosys::ID::D)[i])));
@@ -626,39 +1555,74 @@ struct Network {
 				}
 				imported_cells.push_back(cell);
 			} else if (cell->type.in(ID($_AND_), ID($_NOT_))) {
-				AndNode *node = wire_nodes.at(sigmap(cell->getPort(Yosys::ID::Y)));
+				gate_drivers[sigmap(cell->getPort(Yosys::ID::Y))] = cell;
+				imported_cells.push_back(cell);
+			} else {
+				// There are foreign cells in the module
+				impure_module = true;
+			}
+		}
 
-				if (node->has_foreign_cell_users) {
-					node->po = true;
-					log_assert(node->yw.wire);
+		// The wire node of a gate's output is made a buffer of the gate's
+		// function, with the AND nodes coming out of the structural hash.
+		// Gates are imported fanins first and their inputs are looked up
+		// through the buffers of gates imported so far, so that duplicate
+		// logic is merged all the way up.
+		NodeData<char> gate_imported(false);
+		auto gate_input = [&](RTLIL::Cell *cell, RTLIL::IdString port) {
+			AndNode *wire_node = wire_nodes.at(sigmap(cell->getPort(port)));
+			visit(wire_node);
+			NodeInput in;
+			in.set_node(wire_node);
+			while (in.node && gate_imported[in.node] && in.expand());
+			return in;
+		};
+
+		Yosys::pool<RTLIL::Cell *> gates_seen;
+		std::vector<RTLIL::Cell *> stack;
+		for (auto root : imported_cells)
+		if (root->type != ID($ff)) {
+			stack.push_back(root);
+			while (!stack.empty()) {
+				RTLIL::Cell *cell = stack.back();
+				if (!gates_seen.count(cell)) {
+					gates_seen.insert(cell);
+					for (auto port : {Yosys::ID::A, Yosys::ID::B})
+					if (cell->hasPort(port)) {
+						RTLIL::SigBit bit = sigmap(cell->getPort(port));
+						if (gate_drivers.count(bit) && !gates_seen.count(gate_drivers.at(bit)))
+							stack.push_back(gate_drivers.at(bit));
+					}
+					continue;
+				}
+				stack.pop_back();
 
-					AndNode *indirect_node = new AndNode();
-					node->ins[0].set_node(indirect_node);
-					node->ins[1].set_const(1);
+				AndNode *node = wire_nodes.at(sigmap(cell->getPort(Yosys::ID::Y)));
+				if (gate_imported[node])
+					continue;
 
-					node = indirect_node;
-					node->has_foreign_cell_users = false;
-					node->visited = false;
-					nodes.push_back(node);
+				if (has_foreign_cell_users[node]) {
+					node->po = true;
+					log_assert(ywires[node].wire);
 				}
 
 				NodeInput *ins = node->ins;
-
 				if (cell->type == ID($_AND_)) {
-					ins[0].set_node(wire_nodes.at(sigmap(cell->getPort(Yosys::ID::A))));
-					ins[0].node->visited = true;
-					ins[1].set_node(wire_nodes.at(sigmap(cell->getPort(Yosys::ID::B))));
-					ins[1].node->visited = true;
-				} else if (cell->type == ID($_NOT_)) {
-					ins[0].set_node(wire_nodes.at(sigmap(cell->getPort(Yosys::ID::A))));
-					ins[0].node->visited = true;
+					NodeInput a = gate_input(cell, Yosys::ID::A);
+					NodeInput b = gate_input(cell, Yosys::ID::B);
+					AndNode *gate = and_node(a, b);
+					ins[0].set_node(gate);
+					// The buffer gets expanded away, so its name goes to
+					// the AND node unless it stays on as a PO. (A copy, as
+					// `labels` may grow for the new node.)
+					if (!node->po)
+						combine_label(gate, std::string(labels[node]));
+				} else {
+					ins[0] = gate_input(cell, Yosys::ID::A);
 					ins[0].negate();
-					ins[1].set_const(1);
 				}
-				imported_cells.push_back(cell);
-			} else {
-				// There are foreign cells in the module
-				impure_module = true;
+				ins[1].set_const(1);
+				gate_imported[node] = true;
 			}
 		}
 
@@ -666,7 +1630,7 @@ struct Network {
 			m->remove(cell);
 
 		for (auto node : nodes)
-		if (node->has_foreign_cell_users && node->visited && !node->po)
+		if (has_foreign_cell_users[node] && visited(node) && !node->po)
 			node->pi = true;
 
 		clean(false);
@@ -678,7 +1642,7 @@ struct Network {
 		if (!node->po && !node->pi)
 			nnodes++;
 
-		log("Imported %d nodes\n", nnodes);
+		nlog("Imported %d nodes\n", nnodes);
 	}
 
 	void yosys_perimeter(RTLIL::Module *m)
@@ -686,9 +1650,9 @@ struct Network {
 		(void) m;
 		for (auto node : nodes)
 		if (!node->po && !node->pi)
-			node->yw = RTLIL::SigBit();
+			ywires[node] = RTLIL::SigBit();
 		else
-			log_assert(node->yw.wire);
+			log_assert(ywires[node].wire);
 	}
 
 	void yosys_wires(RTLIL::Module *m, bool mapping_only=false)
@@ -696,16 +1660,15 @@ struct Network {
 		for (auto node : nodes) {
 			if (mapping_only && !node->map_fanouts)
 				continue;
-			if (node->yw.wire)
+			if (ywires[node].wire)
 				continue;
 			RTLIL::Wire *w;
-			RTLIL::IdString label = node->label;
-			if (label.empty())
-				label = NEW_ID;
+			RTLIL::IdString label = labels[node].empty()
+					? NEW_ID : RTLIL::IdString(labels[node]);
 			while (m->wire(label))
 				label = Yosys::stringf("%s_", label.c_str());
 			w = m->addWire(label, 1);
-			node->yw = RTLIL::SigBit(w, 0);
+			ywires[node] = RTLIL::SigBit(w, 0);
 		}
 	}
 
@@ -724,59 +1687,64 @@ struct Network {
 
 			for (int j = 0; j < 2; j++) {
 				if (nin[j].node)
-					yin[j] = nin[j].node->yw;
+					yin[j] = ywires[nin[j].node];
 				else
 					yin[j] = RTLIL::State::S0;
 
-				log_assert(nin[j].feat.lag == (int) nin[j].feat.initvals.size());
-				for (auto it = nin[j].feat.initvals.rbegin();
-						it != nin[j].feat.initvals.rend(); it++) {
+				log_assert(nin[j].feat.lag == nin[j].feat.initvals.size());
+				for (int k = nin[j].feat.initvals.size() - 1; k >= 0; k--) {
+					State initval = nin[j].feat.initvals[k];
 					RTLIL::SigBit q = m->addWire(NEW_ID, 1);
 					m->addFf(NEW_ID, yin[j], q);
-					if (*it != State::Sx)
+					if (initval != State::Sx)
 						q.wire->attributes[RTLIL::ID::init] =
-							RTLIL::Const(*it != State::S0 ? 1 : 0, 1);
+							RTLIL::Const(initval != State::S0 ? 1 : 0, 1);
 					yin[j] = q;
 				}
 				if (nin[j].feat.negated)
 					yin[j] = m->NotGate(NEW_ID, yin[j]);
 			}
-			m->addAndGate(NEW_ID, yin[0], yin[1], node->yw);
+			m->addAndGate(NEW_ID, yin[0], yin[1], ywires[node]);
 		}
 	}
 
 	int clean(bool verbose=true)
 	{
 		std::vector<AndNode*> used;
+		begin_traversal();
 		for (auto node : nodes)
 		if (node->po || node->pi) {
-			node->visited = true;
+			visit(node);
 			used.push_back(node);
-		} else {
-			node->visited = false;
 		}
 
 		for (int i = 0; i < (int) used.size(); i++) {
 			for (auto in : used[i]->fanins()) {
-				if (!in->visited) {
+				if (!visited(in)) {
 					used.push_back(in);
-					in->visited = true;
+					visit(in);
 				}
 			}
 		}
 
-		int nremoved = 0;
+		std::vector<AndNode*> dead;
 		for (auto node : nodes)
-		if (!node->visited) {
-			nremoved++;
-			delete node;
+		if (!visited(node))
+			dead.push_back(node);
+		int nremoved = dead.size();
+		for (auto node : dead) {
+			labels[node].clear();
+			ywires[node] = RTLIL::SigBit();
+			selected_cut(node)[0] = Lit::null();
 		}
+		arena.release(dead);
 
 		std::reverse(used.begin(), used.end());
 		used.swap(nodes);
+		rehash();
 
 		if (verbose)
-			log("Removed %d unused nodes\n", nremoved);
+			nlog("Removed %d unused nodes\n", nremoved);
 		return nremoved;
 	}
 
@@ -795,40 +1763,37 @@ struct Network {
 
 	void check_sort()
 	{
-		for (auto node : nodes)
-			node->visited = false;
-
+		begin_traversal();
 		for (auto node : nodes) {
 			if (!node->pi) {
 				if (node->ins[0].node)
-					log_assert(node->ins[0].node->visited);
+					log_assert(visited(node->ins[0].node));
 				if (node->ins[1].node)
-					log_assert(node->ins[1].node->visited);
+					log_assert(visited(node->ins[1].node));
 			}
-			node->visited = true;
+			visit(node);
 		}
 	}
 
 	void tsort()
 	{
 		std::vector<AndNode*> order;
+		NodeData<int> refs(arena, 0);
 
-		for (auto node : nodes)
-			node->refs = 0;
 		for (auto node : nodes)
 		for (auto fanin : node->fanins())
-			fanin->refs++;
+			refs[fanin]++;
 
 		for (auto node : nodes)
-		if (!node->refs)
+		if (!refs[node])
 			order.push_back(node);
 
 		for (int i = 0; i < (int) order.size(); i++)
 		for (auto fanin : order[i]->fanins()) {
-			fanin->refs--;
-			if (!fanin->refs)
+			refs[fanin]--;
+			if (!refs[fanin])
 				order.push_back(fanin);
-			log_assert(fanin->refs >= 0);
+			log_assert(refs[fanin] >= 0);
 		}
 
 		std::reverse(order.begin(), order.end());
@@ -857,14 +1822,13 @@ struct Network {
 		frontier_size = 1; // first item is special (used for PO scratch)
 		std::vector<int> free_indices;
 
-		for (auto node : nodes) {
+		begin_traversal();
+		for (auto node : nodes)
 			node->fid = 0;
-			node->visited = false;
-		}
 
 		for (auto it = nodes.rbegin(); it != nodes.rend(); it++) {
 			for (auto node : (*it)->fanins()) {
-				log_assert(!node->visited);
+				log_assert(!visited(node));
 				if (!node->fid) {
 					if (free_indices.empty())
 						free_indices.push_back(frontier_size++);
@@ -876,11 +1840,62 @@ struct Network {
 			// free our index
 			if ((*it)->fid != 0)
 				free_indices.push_back((*it)->fid);
-			(*it)->visited = true;
+			visit(*it);
 		}
 
 		check_frontier();
-		log("Frontier is %d wide at its peak\n", frontier_size);
+		nlog("Frontier is %d wide at its peak\n", frontier_size);
+	}
+
+	// Frontier for processing the nodes a level at a time (see cuts<>).
+	// A node's slot is held from its level through the last level reading
+	// it, so that nodes of a level don't share slots with each other or
+	// with any fanin still to be read. Passes which run serially keep to
+	// the topological order and the slots from frontier().
+	void level_frontier()
+	{
+		NodeData<int> level(arena, 0), last_use(arena, 0);
+		int nlevels = 0;
+		for (auto node : nodes) {
+			for (auto fanin : node->fanins())
+				level[node] = std::max(level[node], level[fanin] + 1);
+			last_use[node] = level[node];
+			nlevels = std::max(nlevels, level[node] + 1);
+		}
+		for (auto node : nodes)
+		for (auto fanin : node->fanins())
+			last_use[fanin] = std::max(last_use[fanin], level[node]);
+
+		level_bounds.assign(nlevels, 0);
+		for (auto node : nodes)
+			level_bounds[level[node]]++;
+		for (int l = 1; l < nlevels; l++)
+			level_bounds[l] += level_bounds[l - 1];
+		level_order.resize(nodes.size());
+		for (auto it = nodes.rbegin(); it != nodes.rend(); it++)
+			level_order[--level_bounds[level[*it]]] = *it;
+		for (int l = 0; l < nlevels; l++)
+			level_bounds[l] = l + 1 < nlevels ? level_bounds[l + 1] : nodes.size();
+
+		level_slots = NodeData<int>(arena, 0);
+		level_frontier_size = 0;
+		std::vector<int> free_indices;
+		std::vector<std::vector<int>> released(nlevels);
+		int start = 0;
+		for (int l = 0; l < nlevels; l++) {
+			for (int i = start; i < level_bounds[l]; i++) {
+				AndNode *node = level_order[i];
+				if (free_indices.empty())
+					free_indices.push_back(level_frontier_size++);
+				level_slots[node] = free_indices.back();
+				free_indices.pop_back();
+				released[last_use[node]].push_back(level_slots[node]);
+			}
+			free_indices.insert(free_indices.end(), released[l].begin(), released[l].end());
+			start = level_bounds[l];
+		}
+
+		nlog("Level frontier is %d wide at its peak over %d levels\n", level_frontier_size, nlevels);
 	}
 
 	int walk_mapping(const LutLibrary &lib, bool verbose=false)
@@ -907,81 +1922,104 @@ struct Network {
 			if (node->pi || node->po)
 				continue;
 			if (node->map_fanouts)
-				area += lib.lookup(CutList(node->cut).size).cost;
+				area += lib.lookup(cutlist(node).size).cost;
 			if (node->map_fanouts == 1)
 				support_area++;
 		}
 
 		if (verbose)
-			log("Mapping: Area is %d (of this %d nodes are single-fanout)\n",
+			nlog("Mapping: Area is %d (of this %d nodes are single-fanout)\n",
 				area, support_area);
 
 		return area;
 	}
 
+	void apply_replacements(AndNode *node, NodeData<AndNode*> &replacement)
+	{
+		for (int i = 0; i < 2; i++)
+		while (node->ins[i].node && replacement[node->ins[i].node]) {
+			log_assert(node->ins[i].node != replacement[node->ins[i].node]);
+			node->ins[i].node = replacement[node->ins[i].node];
+		}
+	}
+
 	void unique()
 	{
 		tsort();
 
+		NodeData<AndNode*> replacement(arena, nullptr);
 		for (auto node : nodes) {
-			node->replacement = NULL;
 			if (node->ins[1] < node->ins[0])
 				std::swap(node->ins[0], node->ins[1]);	
 		}
 
-		dict<std::pair<NodeInput, NodeInput>, AndNode*> repr;
+		strash.clear();
 		for (auto node : nodes)
 		if (!node->pi) {
-			node->apply_replacements();
+			apply_replacements(node, replacement);
 
 			if (node->po) continue;
-			auto in_pair = std::make_pair(node->ins[0], node->ins[1]);
-			if (!repr.count(in_pair))
-				repr[in_pair] = node;
+			if (AndNode *repr = strash.lookup(arena, node->ins[0], node->ins[1]))
+				replacement[node] = repr;
 			else
-				node->replacement = repr.at(in_pair);
+				strash.insert(arena, node);
 		}
 		clean();
 	}
 
-	void collect(std::vector<NodeInput> &vec, CoverNode node)
+	// Scratch state of the balance pass
+	struct BalanceData {
+		NodeData<AndNode*> replacement;
+		NodeData<char> feeds_inverter;
+		NodeData<int> andtree_counter;
+
+		BalanceData(const NodeArena &arena)
+			: replacement(arena, nullptr), feeds_inverter(arena, false),
+			  andtree_counter(arena, 2) {}
+	};
+
+	void collect(BalanceData &bd, std::vector<NodeInput> &vec, AndNode *node)
 	{
-		if (node.img->pi) {
-			vec.emplace_back(node, false);
+		if (node->pi) {
+			vec.emplace_back(CoverNode{0, node}, false);
 			return;
 		}
 
+		// Lagged edges end the tree, registers can't be pushed
+		// through the balancing
 		for (int i = 0; i < 2; i++)
-		if (node.img->ins[i].node) {
-			if (node.img->ins[i].node->fanouts > 1 || node.img->ins[i].node->feeds_inverter) {
-				vec.emplace_back(node.img->ins[i].cover_node(),
-								 node.img->ins[i].feat.negated);
+		if (node->ins[i].node) {
+			if (node->ins[i].node->fanouts > 1 || bd.feeds_inverter[node->ins[i].node]
+					|| node->ins[i].feat.lag) {
+				vec.push_back(node->ins[i]);
 			} else {
-				collect(vec, node.img->ins[i].cover_node());
+				collect(bd, vec, node->ins[i].node);
 			}
 		}
 	}
 
-	AndNode *balance_tree(AndNode *root)
+	AndNode *balance_tree(BalanceData &bd, AndNode *root)
 	{
 		std::vector<NodeInput> vec;
+		bool created = false;
 
-		collect(vec, CoverNode{0, root});
-		std::sort(vec.begin(), vec.end(), [](NodeInput a, NodeInput b){
+		collect(bd, vec, root);
+		std::sort(vec.begin(), vec.end(), [](const NodeInput &a, const NodeInput &b){
 			return a.node->depth > b.node->depth;
 		});
 		log_assert(vec.size() > 1);
 
 		while (vec.size() > 1) {
-			AndNode *new_node = new AndNode();
-			nodes.push_back(new_node);
-			new_node->ins[0] = vec.back(); vec.pop_back();
-			new_node->ins[1] = vec.back(); vec.pop_back();
-			new_node->fanouts = 1;
-			new_node->depth = std::max(
-					new_node->ins[0].node->depth, new_node->ins[1].node->depth) + 1;
+			NodeInput a = vec.back(); vec.pop_back();
+			NodeInput b = vec.back(); vec.pop_back();
+			// May be a node already present elsewhere, in which case it
+			// gains a fanout
+			AndNode *new_node = and_node(a, b, &created);
+			new_node->fanouts++;
+			if (created)
+				new_node->depth = std::max(a.node->depth, b.node->depth) + 1;
 			vec.emplace_back(CoverNode{0, new_node}, false);
-			std::sort(vec.begin(), vec.end(), [](NodeInput a, NodeInput b){
+			std::sort(vec.begin(), vec.end(), [](const NodeInput &a, const NodeInput &b){
 				return a.node->depth > b.node->depth;
 			});
 		}
@@ -989,10 +2027,22 @@ struct Network {
 
 		AndNode *ret = vec.front().node;
 		log_assert(!vec.front().feat.negated);
-		std::swap(ret->fanouts, root->fanouts);
-		ret->feeds_inverter = root->feeds_inverter;
-		ret->andtree_counter = root->andtree_counter;
-		ret->replacement = NULL;
+		if (ret == root) {
+			// The tree hashed back to itself, drop the fanout counted
+			// for it above
+			ret->fanouts--;
+			return ret;
+		}
+		bd.feeds_inverter[ret] |= bd.feeds_inverter[root];
+		if (created) {
+			std::swap(ret->fanouts, root->fanouts);
+			bd.andtree_counter[ret] = bd.andtree_counter[root];
+			bd.replacement[ret] = NULL;
+		} else {
+			// An existing node takes over the root's fanouts in place of
+			// the one counted for it above, keeping its own state
+			ret->fanouts += root->fanouts - 1;
+		}
 
 		return ret;
 	}
@@ -1002,10 +2052,8 @@ struct Network {
 		tsort();
 		fanouts();
 
+		BalanceData bd(arena);
 		for (auto node : nodes) {
-			node->replacement = NULL;
-			node->feeds_inverter = false;
-			node->andtree_counter = 2;
 			node->depth = 0;
 			for (auto fanin : node->fanins())
 				node->depth = std::max(node->depth, fanin->depth + 1);
@@ -1015,25 +2063,27 @@ struct Network {
 		if (!node->pi)
 		for (int i = 0; i < 2; i++)
 		if (node->ins[i].node && (node->ins[i].feat.negated || node->po))
-			node->ins[i].node->feeds_inverter = true;
+			bd.feeds_inverter[node->ins[i].node] = true;
 
 		unsigned long size = nodes.size();
 		for (unsigned long j = 0; j < size; j++) {
 			AndNode *node = nodes[j];
-			node->apply_replacements();
+			apply_replacements(node, bd.replacement);
 
 			if (!node->pi)
 			for (int i = 0; i < 2; i++) {
-				if (node->ins[i].node && !node->ins[i].node->feeds_inverter
+				if (node->ins[i].node && !bd.feeds_inverter[node->ins[i].node]
 						&& node->ins[i].node->fanouts <= 1)
-					node->andtree_counter += node->ins[i].node->andtree_counter;
+					bd.andtree_counter[node] += bd.andtree_counter[node->ins[i].node];
 			}
 
 			if (!node->pi)
-			if ((node->fanouts > 1 || node->feeds_inverter) \
-					&& node->andtree_counter >= 3) {
+			if ((node->fanouts > 1 || bd.feeds_inverter[node]) \
+					&& bd.andtree_counter[node] >= 3) {
 				// This is the root of an AND tree we want to balance
-				node->replacement = balance_tree(node);
+				AndNode *ret = balance_tree(bd, node);
+				if (ret != node)
+					bd.replacement[node] = ret;
 			}
 		}
 		clean(true);
@@ -1050,31 +2100,33 @@ struct Network {
 		);
 
 		// Assign random vector on a PI
+		NodeData<u64> weval(arena);
 		for (auto node : nodes)
 		if (node->pi)
-			node->weval = u64rand(gen);
+			weval[node] = u64rand(gen);
 
 		int non_po_nodes = 0;
 		for (auto node : nodes)
 		if (!node->po) {
 			non_po_nodes++;
-			node->propagate_weval();
-			hits[node->weval]++; 
+			if (!node->pi)
+				weval[node] = node->ins[0].weval(weval) & node->ins[1].weval(weval);
+			hits[weval[node]]++; 
 		}
 
 		u64 nsat_calls = 0;
 		for (auto pair : hits) {
 			if (pair.second > 10)
-				log("Repeated pattern (%d): %llx\n", pair.second, pair.first);
+				nlog("Repeated pattern (%d): %llx\n", pair.second, (unsigned long long) pair.first);
 			nsat_calls += pair.second * (pair.second - 1);
 		}
 
-		log("Estimated %lld SAT calls for full equivalence checking (cf. %lld in naive arrangement, reduced is %lld %% of naive)\n",
-			nsat_calls, ((u64) non_po_nodes - 1) * non_po_nodes,
-			100 * nsat_calls / (((u64) non_po_nodes - 1) * non_po_nodes));
+		nlog("Estimated %lld SAT calls for full equivalence checking (cf. %lld in naive arrangement, reduced is %lld %% of naive)\n",
+			(long long) nsat_calls, (long long) (((u64) non_po_nodes - 1) * non_po_nodes),
+			(long long) (100 * nsat_calls / (((u64) non_po_nodes - 1) * non_po_nodes)));
 	}
 
-	void apply_timedelta()
+	void apply_timedelta(NodeData<int> &timedelta)
 	{
 		for (auto node : nodes)
 		for (int i = 0; i < 2; i++) {
@@ -1083,8 +2135,8 @@ struct Network {
 
 			log_assert(node->ins[i].feat.initvals_undef());
 			if (node->ins[i].node)
-				node->ins[i].feat.lag += node->timedelta -
-								node->ins[i].node->timedelta;
+				node->ins[i].feat.lag += timedelta[node] -
+								timedelta[node->ins[i].node];
 			else
 				node->ins[i].feat.lag = 0;
 			node->ins[i].feat.fixup_initvals();
@@ -1096,90 +2148,382 @@ struct Network {
 	{
 		tsort();
 
+		NodeData<int> timedelta(arena, 0);
 		for (auto node : nodes) {
-			if (node->pi) {
-				node->timedelta = 0;
+			if (node->pi)
 				continue;
-			}
 
 			int mindelta = -2;
 			for (auto fanin : CoverNode{0, node}.fanins())
-				mindelta = std::max(mindelta, fanin.img->timedelta - fanin.lag);
+				mindelta = std::max(mindelta, timedelta[fanin.img] - fanin.lag);
 
-			node->timedelta = mindelta + (rand() % 2);
+			timedelta[node] = mindelta + (rand() % 2);
 		}
 
-		apply_timedelta();
+		apply_timedelta(timedelta);
+	}
+
+	// Select the cut made up of the node's immediate fanins
+	void set_trivial_cut(AndNode *node)
+	{
+		log_assert(cut_width >= 2);
+		Lit *cut = selected_cut(node);
+		int pos = 0;
+		u64 tt = ~(u64) 0;
+		if (!node->pi)
+		for (auto &in : node->ins) {
+			u64 in_tt = in.feat.negated ? ~(u64) 0 : 0;
+			if (in.node) {
+				in_tt ^= tt_var_masks[pos];
+				cut[pos++] = CoverNode{in.feat.lag, in.node}.lit();
+			}
+			tt &= in_tt;
+		}
+		cut[pos] = Lit::null();
+		std::fill(selected_tt(node), selected_tt(node) + tt_words, tt);
 	}
 
 	void trivial_cuts()
 	{
+		set_cut_width(std::max(cut_width, 2));
 		for (auto node : nodes) {
 			node->map_fanouts = 0;
-			int pos = 0;
-			for (auto fanin : CoverNode{0, node}.fanins())
-				node->cut[pos++] = fanin;
-			if (pos < CUT_MAXIMUM)
-				node->cut[pos].img = NULL;
+			set_trivial_cut(node);
 		}
 
 		LutLibrary lib = LutLibrary::academic_luts(2);
 		walk_mapping(lib);
 	}
 
-	static void deref_cut(AndNode *node)
+	// Cone of LUTs visited by ref_cut() or deref_cut()
+	struct MffcStats {
+		int size = 0;
+		int area = 0; // only summed if a library is provided
+	};
+
+	// Reference (or dereference) the leaves of the cut selected on `root`,
+	// continuing into the cuts of any leaves whose `map_fanouts` count
+	// becomes nonzero (or drops to zero). The returned cone is the
+	// maximum fanout-free cone of `root` under the mapping, `root`
+	// included. Uses an explicit stack so deep networks are safe.
+	MffcStats walk_mffc(AndNode *root, bool ref, const LutLibrary *lib)
 	{
-		if (!node->pi)
-		for (auto cut_node : CutList{node->cut}) {
-			log_assert(cut_node.img != node);
-			log_assert(cut_node.img->map_fanouts >= 1);
-			if (!--cut_node.img->map_fanouts)
-				deref_cut(cut_node.img);
+		MffcStats stats;
+		std::vector<AndNode*> &stack = mffc_stack;
+		log_assert(stack.empty());
+		stack.push_back(root);
+
+		while (!stack.empty()) {
+			AndNode *node = stack.back();
+			stack.pop_back();
+			if (node->pi)
+				continue;
+
+			CutList cut = cutlist(node);
+			stats.size++;
+			if (lib)
+				stats.area += lib->lookup(cut.size).cost;
+
+			for (auto cut_node : cut) {
+				log_assert(cut_node.img != node);
+				if (ref) {
+					if (!cut_node.img->map_fanouts++)
+						stack.push_back(cut_node.img);
+				} else {
+					log_assert(cut_node.img->map_fanouts >= 1);
+					if (!--cut_node.img->map_fanouts)
+						stack.push_back(cut_node.img);
+				}
+			}
 		}
+
+		return stats;
 	}
 
-	static int ref_cut(AndNode *node)
+	MffcStats ref_cut(AndNode *node, const LutLibrary *lib=nullptr)
 	{
-		int sum = 0;
-		if (!node->pi)
-		for (auto cut_node : CutList{node->cut}) {
-			log_assert(cut_node.img != node);
-			if (!cut_node.img->map_fanouts++)
-				sum += 1 + ref_cut(cut_node.img);
-			log_assert(cut_node.img->map_fanouts >= 1);
+		return walk_mffc(node, true, lib);
+	}
+
+	MffcStats deref_cut(AndNode *node, const LutLibrary *lib=nullptr)
+	{
+		return walk_mffc(node, false, lib);
+	}
+
+	// References added on top of `map_fanouts` by one thread while it
+	// evaluates cuts against a mapping it mustn't modify
+	struct RefOverlay {
+		std::vector<int> refs;
+		std::vector<int> touched;
+		std::vector<AndNode*> stack;
+	};
+
+	// Area of the LUTs which selecting `cut` would add to the mapping,
+	// like ExactAreaEval::calc_exact_area() but with the references
+	// counted in `overlay`. Expects the node's current cut to be
+	// dereferenced.
+	int overlay_cut_area(const LutLibrary &lib, CutList cut, RefOverlay &overlay)
+	{
+		if (overlay.refs.size() < (size_t) arena.id_bound())
+			overlay.refs.resize(arena.id_bound());
+		std::vector<AndNode*> &stack = overlay.stack;
+		log_assert(stack.empty() && overlay.touched.empty());
+
+		auto ref = [&](AndNode *node) {
+			if (!overlay.refs[node->id]++) {
+				overlay.touched.push_back(node->id);
+				if (!node->map_fanouts)
+					stack.push_back(node);
+			}
+		};
+
+		int area = lib.lookup(cut.size).cost;
+		for (auto cut_node : cut)
+			ref(cut_node.img);
+
+		while (!stack.empty()) {
+			AndNode *node = stack.back();
+			stack.pop_back();
+			if (node->pi)
+				continue;
+
+			CutList node_cut = cutlist(node);
+			area += lib.lookup(node_cut.size).cost;
+			for (auto cut_node : node_cut)
+				ref(cut_node.img);
 		}
-		return sum;
+
+		for (int id : overlay.touched)
+			overlay.refs[id] = 0;
+		overlay.touched.clear();
+		return area;
 	}
 
+	// Whether the packed leaves of cut `a` are a subset of those of cut `b`,
+	// with the signatures ruling out most non-subsets up front. Both cuts
+	// are expected to be sorted.
+	static bool cut_subset(const uint32_t *a, int a_len, u64 a_sig,
+						   const uint32_t *b, int b_len, u64 b_sig)
+	{
+		if ((a_sig & ~b_sig) || a_len > b_len)
+			return false;
+
+		int j = 0;
+		for (int i = 0; i < a_len; i++) {
+			while (j < b_len && b[j] < a[i])
+				j++;
+			if (j == b_len || b[j] != a[i])
+				return false;
+			j++;
+		}
+		return true;
+	}
+
+	// Leaves in the cut cache are packed into 32 bits: the node ID in the
+	// low `leaf_id_bits` and the lag above it. The packing keeps the order
+	// of literals. Cuts with a leaf lagged too far to pack are dropped.
+	int leaf_id_bits = 0;
+
+	void setup_leaf_packing()
+	{
+		leaf_id_bits = 1;
+		while (leaf_id_bits < 32 && ((u64) 1 << leaf_id_bits) < arena.id_bound())
+			leaf_id_bits++;
+
+		// Trivial cuts have to be representable
+		int max_lag = (int) std::min<u64>(((u64) 1 << (32 - leaf_id_bits)) - 1,
+										  std::numeric_limits<int>::max());
+		for (auto node : nodes)
+		for (int i = 0; i < 2; i++)
+		if (node->ins[i].node && node->ins[i].feat.lag > max_lag)
+			map_error("Lag of %d on a node input exceeds the limit of %d for a network of this size.\n",
+					  node->ins[i].feat.lag, max_lag);
+	}
+
+	bool leaf_fits(Lit lit) const
+	{
+		return ((u64) lit.lag() >> (32 - leaf_id_bits)) == 0;
+	}
+
+	uint32_t pack_leaf(Lit lit) const
+	{
+		return ((uint32_t) lit.lag() << leaf_id_bits) | lit.id();
+	}
+
+	Lit unpack_leaf(uint32_t leaf) const
+	{
+		return Lit::make(leaf & (((u64) 1 << leaf_id_bits) - 1), leaf >> leaf_id_bits);
+	}
+
+	// Number of priority cuts each node may keep under `cut_budget`. The
+	// most critical nodes, by depth slack and then by fanout, keep the full
+	// `ncuts`; the rest get by with two. The split is chosen so the average
+	// meets the budget.
+	NodeData<int> cut_allowance(int ncuts)
+	{
+		NodeData<int> allowance(arena, ncuts);
+		if (!cut_budget || cut_budget >= ncuts)
+			return allowance;
+
+		std::vector<AndNode*> order;
+		for (auto node : nodes)
+		if (!node->pi && !node->po)
+			order.push_back(node);
+
+		int low = std::min(2, cut_budget);
+		size_t nfull = (size_t) (cut_budget - low) * order.size() / (ncuts - low);
+		auto key = [](const AndNode *node) {
+			return std::make_tuple((long) node->depth_limit - node->depth,
+								   -node->fanouts, node->id);
+		};
+		std::nth_element(order.begin(), order.begin() + nfull, order.end(),
+				[&](const AndNode *a, const AndNode *b) { return key(a) < key(b); });
+
+		for (size_t i = nfull; i < order.size(); i++)
+			allowance[order[i]] = low;
+		return allowance;
+	}
+
+	// Merge two sorted, null-terminated leaf arrays into `out`, noting
+	// where each leaf of `a` and `b` lands in `a_pos` and `b_pos`. Those
+	// need room for one entry past the last leaf. Returns the size of the
+	// merged cut, or -1 as soon as it's seen to exceed `max`. Apart from
+	// the loop exits, there's no branching on the leaves.
+	static int merge_leaves(const Lit *a, const Lit *b, Lit *out,
+							int *a_pos, int *b_pos, int max)
+	{
+		int i = 0, j = 0, n = 0;
+
+		// Both sides are done once both stand on the terminator
+		while ((a[i].v & b[j].v) != ~(u64) 0) {
+			if (n == max)
+				return -1;
+			u64 x = a[i].v, y = b[j].v;
+			u64 m = std::min(x, y);
+			// Overwritten until the leaf is consumed
+			a_pos[i] = n;
+			b_pos[j] = n;
+			i += (x == m);
+			j += (y == m);
+			out[n++] = Lit{m};
+		}
+		out[n] = Lit::null();
+		return n;
+	}
+
+	// Call `f` with the narrowest instantiated cut width fitting
+	// `max_cut`, as a std::integral_constant
+	template<typename F>
+	static auto with_cut_width(int max_cut, F f)
+	{
+		if (max_cut <= 4)
+			return f(std::integral_constant<int, 4>());
+		else if (max_cut <= 6)
+			return f(std::integral_constant<int, 6>());
+		else if (max_cut <= 8)
+			return f(std::integral_constant<int, 8>());
+		else
+			return f(std::integral_constant<int, CUT_MAXIMUM>());
+	}
+
+	static size_t cut_set_bytes(int max_cut)
+	{
+		return with_cut_width(max_cut, [](auto k) {
+			return sizeof(CutSet<decltype(k)::value, NPRIORITY_CUTS>);
+		});
+	}
+
+	// The cut engine is instantiated for a handful of cut widths, with the
+	// narrowest one fitting the library picked at runtime. Storage is
+	// sized after the instantiated width.
 	template<typename CutEvaluation>
 	void cuts(LutLibrary &lib, bool consider_previous_cut=true, bool late_reject=false)
 	{
-		log_assert(CUT_MAXIMUM >= 3);
-
 		int max_cut;
 		if (lib.max_width() > CUT_MAXIMUM) {
-			log_warning("LUTs wider than %d are ignored as mapping targets.\n", CUT_MAXIMUM);
+			nlog_warning("LUTs wider than %d are ignored as mapping targets.\n", CUT_MAXIMUM);
 			max_cut = CUT_MAXIMUM;
 		} else {
 			max_cut = lib.max_width();
 		}
 
-		struct NodeCache {
-			int ps_len;
-			struct PriorityCut {
-				CoverNode cut[CUT_MAXIMUM];
-			} ps[NPRIORITY_CUTS];
-			AndNode *mark;
-		};
+		with_cut_width(max_cut, [&](auto k) {
+			cuts<CutEvaluation, decltype(k)::value, NPRIORITY_CUTS>(lib, max_cut,
+					consider_previous_cut, late_reject);
+		});
 
-		NodeCache *cache = new NodeCache[frontier_size];
+		if (true)
+			nlog("%4s A=%6d\n", CutEvaluation::prefix(), walk_mapping(lib));
+	}
 
-		// Go over the nodes in topological order
-		for (auto node : nodes) {
-			// Clear the cache
-			NodeCache *lcache = &cache[node->fid];
-			lcache->ps_len = 0;
-			lcache->mark = node;
+	template<typename CutEvaluation, int K, int NCuts>
+	void cuts(LutLibrary &lib, int max_cut, bool consider_previous_cut, bool late_reject)
+	{
+		static_assert(K >= 3 && K <= CUT_MAXIMUM, "unsupported cut width");
+		log_assert(max_cut <= K);
+		set_cut_width(K);
+
+		typedef CutSet<K, NCuts> NodeCache;
+
+		// With the nodes processed a level at a time on several threads,
+		// reference counts are left alone during the pass and rebuilt
+		// afterwards. Evaluators allowed to run this way only read the
+		// counter of the node itself, which no node on the same or a lower
+		// level changes.
+		bool parallel = threads > 1 && CutEvaluation::level_parallel && !level_order.empty();
+		bool track_refs = !parallel;
+
+		// With cut reuse the sets are kept in `cut_store` by node ID so they
+		// outlive the pass. Otherwise they are indexed by frontier slot and
+		// dropped as soon as the node leaves the frontier.
+		CutStore<K, NCuts> *store = nullptr;
+		std::vector<NodeCache> frontier_cache;
+		bool stored_sets = false;
+		if (reuse_cuts) {
+			store = dynamic_cast<CutStore<K, NCuts>*>(cut_store.get());
+			if (store) {
+				stored_sets = true;
+			} else {
+				store = new CutStore<K, NCuts>;
+				cut_store.reset(store);
+			}
+			store->pass++;
+			store->sets.resize(arena.id_bound());
+		} else {
+			frontier_cache.resize(parallel ? level_frontier_size : frontier_size);
+		}
+		auto cache_of = [&](AndNode *node) {
+			if (store)
+				return &store->sets[node->id];
+			return &frontier_cache[parallel ? level_slots[node] : node->fid];
+		};
+		setup_leaf_packing();
+
+		NodeData<int> allowance = cut_allowance(NCuts);
+		std::atomic<int> nreranked(0);
+
+		// Evaluators which walk the mapping for each candidate can have the
+		// candidates of a node evaluated on several threads, each counting
+		// its references in an overlay. The candidates are then collected
+		// first and offered in order with their evaluations.
+		bool speculate = threads > 1 && CutEvaluation::speculative && track_refs;
+		std::vector<RefOverlay> overlays;
+		struct Candidate {
+			Lit cut[K + 1];
+			uint32_t packed[K];
+			int len;
+			u64 sig;
+			int hash;
+			TruthTable<K> tt;
+		};
+		std::vector<Candidate> candidates;
+		std::vector<std::optional<CutEvaluation>> evals;
+		std::vector<int> ahead;
+		if (speculate)
+			overlays.resize(thread_pool().size());
+
+		auto process = [&](AndNode *node) {
+			NodeCache *lcache = cache_of(node);
 
 			AndNode *n1 = node->ins[0].node;
 			AndNode *n2 = node->ins[1].node;
@@ -1187,19 +2531,39 @@ struct Network {
 			int lag1 = node->ins[0].feat.lag;
 			int lag2 = node->ins[1].feat.lag;
 
-			// Find the best NPRIORITY_CUTS cuts according
+			// If neither of the fanin sets changed in this pass, the
+			// node's own set from the previous pass is only re-ranked
+			bool rerank = stored_sets && !node->pi && !node->po
+					&& cache_of(n1)->changed != store->pass
+					&& cache_of(n2)->changed != store->pass;
+			NodeCache old_set;
+			if (store && !node->pi && !node->po)
+				old_set = *lcache;
+
+			// Clear the cache
+			lcache->ps_len = 0;
+			lcache->mark = node->id;
+
+			// Find the best NCuts cuts according
 			// to CutEvaluation
-			std::map<std::pair<CutEvaluation, int>, int> leaderboard;
+			typedef Leaderboard<CutEvaluation, NCuts> CutLeaderboard;
+			CutLeaderboard leaderboard;
+
+			// Slots in `lcache->ps` vacated by dominated cuts
+			int free_slots[NCuts];
+			int nfree = 0;
 
 			if (node->pi) {
 				// PI has no non-trivial cut
 				lcache->ps_len = 1;
-				lcache->ps[0].cut[0] = CoverNode{0, node};
-				lcache->ps[0].cut[1] = CoverNode{0, NULL};
+				lcache->ps[0].leaves[0] = pack_leaf(Lit::make(node->id));
+				lcache->ps[0].len = 1;
+				lcache->ps[0].tt = TruthTable<K>::var(0);
+				lcache->ps[0].sig = Lit::make(node->id).signature();
 
 				// Selected cut is empty
-				node->cut[0].img = NULL;
-				continue;
+				selected_cut(node)[0] = Lit::null();
+				return;
 			}
 
 			if (node->po) {
@@ -1207,117 +2571,327 @@ struct Network {
 				lcache->ps_len = 0;
 
 				// Selected cut is the trivial one
-				int cutlen = 0;
-				for (auto fanin : CoverNode{0, node}.fanins())
-					node->cut[cutlen++] = fanin;
-				node->cut[cutlen] = CoverNode{0, NULL};
-				continue;
+				set_trivial_cut(node);
+				return;
 			}
 
 			log_assert(n1 && n2);
 
-			CoverNode t1_nodes[2] = { {0, n1}, {0, NULL} };
-			CoverNode t2_nodes[2] = { {0, n2}, {0, NULL} };
-			CutList t1(t1_nodes, 0);
-			CutList t2(t2_nodes, 0);
-
-			CoverNode working_cut[CUT_MAXIMUM];	
-
-			log_assert(cache[n1->fid].mark == n1);
-			log_assert(cache[n2->fid].mark == n2);
+			// Trivial cuts of the fanins
+			uint32_t t1_leaf = pack_leaf(Lit::make(n1->id));
+			uint32_t t2_leaf = pack_leaf(Lit::make(n2->id));
+
+			Lit working_cut[K + 1];
+			uint32_t working_packed[K];
+			bool neg1 = node->ins[0].feat.negated;
+			bool neg2 = node->ins[1].feat.negated;
+
+			NodeCache *cache1 = cache_of(n1);
+			NodeCache *cache2 = cache_of(n2);
+			log_assert(cache1->mark == n1->id);
+			log_assert(cache2->mark == n2->id);
+
+			// Evaluators which measure the cone a cut would add to the
+			// mapping need the node's current cut out of it. Dereference
+			// it once here instead of once per candidate.
+			bool detached = CutEvaluation::detach_cut && track_refs && node->map_fanouts;
+			if (detached)
+				deref_cut(node);
 
 			if (consider_previous_cut) {
 				lcache->ps_len++;
-				log_assert(!CutEvaluation(lib, CutList(node->cut), node).reject(node));
-				std::copy(node->cut, node->cut + CUT_MAXIMUM, lcache->ps[0].cut);
-				leaderboard[
-					std::make_pair(CutEvaluation(lib, CutList(node->cut), node),
-								   std::numeric_limits<int>::max())] = 0;
-				log_assert(!leaderboard.empty());
+				log_assert(!CutEvaluation(*this, lib, cutlist(node), node).reject(node));
+				auto &prev = lcache->ps[0];
+				prev.len = 0;
+				prev.sig = 0;
+				for (auto cut_node : cutlist(node)) {
+					log_assert(leaf_fits(cut_node.lit()));
+					prev.leaves[prev.len++] = pack_leaf(cut_node.lit());
+					prev.sig |= cut_node.lit().signature();
+				}
+				std::copy(selected_tt(node), selected_tt(node) + TruthTable<K>::NWORDS,
+						  prev.tt.w);
+				leaderboard.insert({CutEvaluation(*this, lib, cutlist(node), node),
+									std::numeric_limits<int>::max(), 0});
 			}
 
-			for (int i = -1; i < cache[n1->fid].ps_len; i++)
-			for (int j = -1; j < cache[n2->fid].ps_len; j++) {
-				CutList n1_cut = ((i == -1) ? t1 : cache[n1->fid].ps[i].cut).inject_lag(lag1);
-				CutList n2_cut = ((j == -1) ? t2 : cache[n2->fid].ps[j].cut).inject_lag(lag2);
-
-				// TODO: get rid of `cook`
-				std::vector<CoverNode> cook;
-				std::set_union(
-					n1_cut.begin(), n1_cut.end(),
-					n2_cut.begin(), n2_cut.end(),
-					std::back_inserter(cook))
-				;
-				if ((int) cook.size() > max_cut) continue;
-
-				int cutlen = 0;
-				int hash = 0;
-				for (auto node : cook) {
-					working_cut[cutlen++] = node;
-					hash = Yosys::mkhash(hash, (uintptr_t) node.img);
+			// Consider a candidate for the node's cut set, given packed,
+			// with its function already reduced to its support
+			auto consider = [&](const uint32_t *packed, int len,
+								u64 sig, int hash, const TruthTable<K> &tt, auto make_eval) {
+				// Skip the cut if it's a superset of a cut we already have
+				for (int k = 0; k < leaderboard.size(); k++) {
+					auto &other = lcache->ps[leaderboard[k].slot];
+					if (cut_subset(other.leaves, other.len, other.sig, packed, len, sig))
+						return;
 				}
-				if (cutlen < CUT_MAXIMUM)
-					working_cut[cutlen] = CoverNode{0, NULL};
 
-				auto working_eval = std::make_pair(CutEvaluation(lib, CutList(working_cut), node), hash);
+				typename CutLeaderboard::Entry entry{make_eval(), hash, -1};
 
-				if ((!late_reject && working_eval.first.reject(node))
-						|| leaderboard.count(working_eval))
-					continue;
+				if ((!late_reject && entry.eval.reject(node))
+						|| leaderboard.contains(entry))
+					return;
+
+				// Drop any cuts the new one dominates
+				for (int k = leaderboard.size() - 1; k >= 0; k--) {
+					auto &other = lcache->ps[leaderboard[k].slot];
+					if (cut_subset(packed, len, sig, other.leaves, other.len, other.sig)) {
+						free_slots[nfree++] = leaderboard[k].slot;
+						leaderboard.remove(k);
+					}
+				}
 
 				int slot;
-				if (lcache->ps_len < NPRIORITY_CUTS) {
+				if (nfree) {
+					slot = free_slots[--nfree];
+				} else if (lcache->ps_len < allowance[node]) {
 					// Slot is assured
-					leaderboard[working_eval] = slot = lcache->ps_len++;
+					slot = lcache->ps_len++;
 				} else {
-					// Post the new cut on the leaderboard, and if that sinks one
-					// of the earlier cached cuts below the cutoff, reuse the slot
-					// in the `lcache->ps` array for the new cut
-					leaderboard[working_eval] = -1;
-					slot = (leaderboard.rbegin())->second;
-					leaderboard.erase(std::prev(leaderboard.end()));
-
-					if (slot != -1)
-						leaderboard[working_eval] = slot;
+					// If the new cut would be last on the leaderboard it's
+					// dropped, otherwise it sinks the last of the earlier
+					// cached cuts and takes over its slot in `lcache->ps`
+					if (!(entry < leaderboard.worst()))
+						return;
+					slot = leaderboard.worst().slot;
+					leaderboard.pop_worst();
 				}
- 
-				if (slot == -1)
+				entry.slot = slot;
+				leaderboard.insert(entry);
+
+				std::copy(packed, packed + len, lcache->ps[slot].leaves);
+				lcache->ps[slot].len = len;
+				lcache->ps[slot].tt = tt;
+				lcache->ps[slot].sig = sig;
+			};
+
+			// Consider a candidate given both as a null-terminated array
+			// and packed, its function to be computed by `make_tt`
+			auto offer = [&](const Lit *cut, const uint32_t *packed, int len,
+							 u64 sig, int hash, auto make_tt) {
+				TruthTable<K> tt = make_tt();
+
+				// Drop the leaves the function doesn't depend on. A
+				// constant function keeps its cut as is.
+				Lit reduced[K + 1];
+				uint32_t reduced_packed[K];
+				unsigned int support = drop_vacuous ? tt.shrink(len) : 0;
+				if (support && support != (1u << len) - 1) {
+					int n = 0;
+					sig = 0;
+					hash = 0;
+					for (int k = 0; k < len; k++)
+					if (support & (1 << k)) {
+						reduced[n] = cut[k];
+						reduced_packed[n] = packed[k];
+						sig |= cut[k].signature();
+						hash = Yosys::mkhash(hash, cut[k].hash());
+						n++;
+					}
+					reduced[n] = Lit::null();
+					cut = reduced;
+					packed = reduced_packed;
+					len = n;
+				}
+
+				if (speculate) {
+					candidates.emplace_back();
+					Candidate &c = candidates.back();
+					std::copy(cut, cut + len + 1, c.cut);
+					std::copy(packed, packed + len, c.packed);
+					c.len = len;
+					c.sig = sig;
+					c.hash = hash;
+					c.tt = tt;
+					return;
+				}
+
+				consider(packed, len, sig, hash, tt, [&]() {
+					return CutEvaluation(*this, lib, CutList(arena, const_cast<Lit *>(cut)), node);
+				});
+			};
+
+			// When re-ranking, only the trivial merge of the two fanins is
+			// added to the stored cuts
+			int n1_sets = rerank ? 0 : cache1->ps_len;
+			int n2_sets = rerank ? 0 : cache2->ps_len;
+
+			for (int i = -1; i < n1_sets; i++)
+			for (int j = -1; j < n2_sets; j++) {
+				const uint32_t *n1_leaves = (i == -1) ? &t1_leaf : cache1->ps[i].leaves;
+				const uint32_t *n2_leaves = (j == -1) ? &t2_leaf : cache2->ps[j].leaves;
+				int n1_len = (i == -1) ? 1 : cache1->ps[i].len;
+				int n2_len = (j == -1) ? 1 : cache2->ps[j].len;
+				u64 n1_sig = sig_shift((i == -1) ? Lit::make(n1->id).signature() : cache1->ps[i].sig, lag1);
+				u64 n2_sig = sig_shift((j == -1) ? Lit::make(n2->id).signature() : cache2->ps[j].sig, lag2);
+
+				// Cheap rejection of merges which are sure to be too wide
+				if (__builtin_popcountll(n1_sig | n2_sig) > max_cut)
 					continue;
 
-				std::copy(working_cut, working_cut + CUT_MAXIMUM, lcache->ps[slot].cut);
+				Lit n1_lits[K + 1], n2_lits[K + 1];
+				for (int k = 0; k < n1_len; k++)
+					n1_lits[k] = unpack_leaf(n1_leaves[k]).shift(lag1);
+				n1_lits[n1_len] = Lit::null();
+				for (int k = 0; k < n2_len; k++)
+					n2_lits[k] = unpack_leaf(n2_leaves[k]).shift(lag2);
+				n2_lits[n2_len] = Lit::null();
+
+				int n1_pos[K + 1], n2_pos[K + 1];
+				int cutlen = merge_leaves(n1_lits, n2_lits, working_cut, n1_pos, n2_pos, max_cut);
+				// The leaves are sorted by lag first, so the last one has
+				// the largest lag
+				if (cutlen < 0 || !leaf_fits(working_cut[cutlen - 1]))
+					continue;
+				for (int k = 0; k < cutlen; k++)
+					working_packed[k] = pack_leaf(working_cut[k]);
+
+				int hash = 0;
+				for (int k = 0; k < cutlen; k++)
+					hash = Yosys::mkhash(hash, working_cut[k].hash());
+
+				offer(working_cut, working_packed, cutlen, n1_sig | n2_sig, hash, [&]() {
+					// Function of the merged cut from those of the two
+					// fanin cuts
+					TruthTable<K> tt1 = (i == -1) ? TruthTable<K>::var(0) : cache1->ps[i].tt;
+					TruthTable<K> tt2 = (j == -1) ? TruthTable<K>::var(0) : cache2->ps[j].tt;
+					tt1.stretch(n1_len, n1_pos);
+					tt2.stretch(n2_len, n2_pos);
+					if (neg1)
+						tt1.negate();
+					if (neg2)
+						tt2.negate();
+					return tt1 & tt2;
+				});
 			}
 
+			if (rerank) {
+				nreranked++;
+				for (int k = 0; k < old_set.ps_len; k++) {
+					auto &stored = old_set.ps[k];
+					int hash = 0;
+					for (int l = 0; l < stored.len; l++) {
+						working_cut[l] = unpack_leaf(stored.leaves[l]);
+						hash = Yosys::mkhash(hash, working_cut[l].hash());
+					}
+					working_cut[stored.len] = Lit::null();
+					offer(working_cut, stored.leaves, stored.len, stored.sig, hash,
+						  [&]() { return stored.tt; });
+				}
+			}
+
+			if constexpr (CutEvaluation::speculative)
+			if (speculate) {
+				// Candidates which are supersets of an earlier one or of a
+				// cut on the leaderboard are likely skipped by consider(), so
+				// they are left to be evaluated there if they aren't
+				ahead.clear();
+				for (int k = 0; k < (int) candidates.size(); k++) {
+					const Candidate &c = candidates[k];
+					bool superset = false;
+					for (int l = 0; l < k && !superset; l++)
+						superset = cut_subset(candidates[l].packed, candidates[l].len, candidates[l].sig,
+											  c.packed, c.len, c.sig);
+					for (int l = 0; l < leaderboard.size() && !superset; l++) {
+						auto &other = lcache->ps[leaderboard[l].slot];
+						superset = cut_subset(other.leaves, other.len, other.sig, c.packed, c.len, c.sig);
+					}
+					if (!superset)
+						ahead.push_back(k);
+				}
+
+				// The mapping is only read until the candidates are all
+				// evaluated, and only the winner is referenced below. Too
+				// few candidates aren't worth a batch of tasks.
+				evals.clear();
+				evals.resize(candidates.size());
+				if ((int) ahead.size() >= MIN_SPECULATED_CUTS)
+					thread_pool().parallel_for(ahead.size(), [&](int i) {
+						int k = ahead[i];
+						evals[k].emplace(*this, lib, CutList(arena, candidates[k].cut),
+										 node, overlays[ThreadPool::worker_index()]);
+					}, 4);
+				for (int k = 0; k < (int) candidates.size(); k++) {
+					Candidate &c = candidates[k];
+					consider(c.packed, c.len, c.sig, c.hash, c.tt, [&]() {
+						if (evals[k])
+							return *evals[k];
+						return CutEvaluation(*this, lib, CutList(arena, c.cut), node);
+					});
+				}
+				candidates.clear();
+			}
+
+			// Close up the gaps left by dominated cuts, so that the cache
+			// holds `ps_len` cuts at the front
+			if (nfree) {
+				bool used[NCuts] = {};
+				lcache->ps_len = leaderboard.size();
+				for (int k = 0; k < leaderboard.size(); k++)
+				if (leaderboard[k].slot < lcache->ps_len)
+					used[leaderboard[k].slot] = true;
+
+				int free = 0;
+				for (int k = 0; k < leaderboard.size(); k++)
+				if (leaderboard[k].slot >= lcache->ps_len) {
+					while (used[free])
+						free++;
+					lcache->ps[free] = lcache->ps[leaderboard[k].slot];
+					leaderboard[k].slot = free;
+					used[free] = true;
+				}
+			}
+
+			if (store && !lcache->same_cuts(old_set))
+				lcache->changed = store->pass;
+
 			log_assert(!leaderboard.empty());
-			CoverNode *best_cut = lcache->ps[leaderboard.begin()->second].cut;
+			const auto &best = lcache->ps[leaderboard.best().slot];
 
-			if (late_reject && leaderboard.begin()->first.first.reject(node))
+			if (late_reject && leaderboard.best().eval.reject(node))
 				goto done;
-			log_assert(!leaderboard.begin()->first.first.reject(node));
+			log_assert(!leaderboard.best().eval.reject(node));
 
-			if (node->map_fanouts)
+			if (track_refs && node->map_fanouts && !detached)
 				deref_cut(node);
 
-			std::copy(best_cut, best_cut + CUT_MAXIMUM, node->cut);
-			leaderboard.begin()->first.first.select_on(node);
+			for (int k = 0; k < best.len; k++)
+				selected_cut(node)[k] = unpack_leaf(best.leaves[k]);
+			selected_cut(node)[best.len] = Lit::null();
+			std::copy(best.tt.w, best.tt.w + TruthTable<K>::NWORDS, selected_tt(node));
+			leaderboard.best().eval.select_on(node);
 
-			if (node->map_fanouts)
+			if (track_refs && node->map_fanouts)
 				ref_cut(node);
+			detached = false;
 
 		done:
+			if (detached)
+				ref_cut(node);
+
 			{
 				int depth = 0;
-				for (auto cut_node : CutList{node->cut}) {
+				for (auto cut_node : cutlist(node)) {
 					depth = std::max(depth, cut_node.img->depth + 1);
 				}
 				node->depth = depth;
 			}
-		}
+		};
 
-		delete[] cache;
+		if (parallel) {
+			thread_pool().parallel_levels(level_bounds, [&](int i) { process(level_order[i]); });
 
-		if (true)
-			log("%4s A=%6d\n", CutEvaluation::prefix(), walk_mapping(lib));
+			for (auto node : nodes)
+				node->map_fanouts = 0;
+			walk_mapping(lib);
+		} else {
+			// Go over the nodes in topological order
+			for (auto node : nodes)
+				process(node);
+		}
 
+		if (stored_sets)
+			nlog("Re-ranked stored cuts on %d nodes\n", nreranked.load());
 	}
 
 	struct DepthEval {
@@ -1326,7 +2900,18 @@ struct Network {
 		double area_flow;
 		int edge_flow;
 
-		DepthEval(LutLibrary &lib, CutList cutlist, AndNode *node, bool area_flow2=false)
+		// Whether cuts<> should dereference the node's current cut while
+		// the evaluator is run on candidates
+		static const bool detach_cut = false;
+
+		// Whether cuts<> may evaluate the nodes of one level concurrently
+		static const bool level_parallel = true;
+
+		// Whether cuts<> may evaluate the candidates of one node
+		// concurrently, through a constructor taking a RefOverlay
+		static const bool speculative = false;
+
+		DepthEval(Network &net, LutLibrary &lib, CutList cutlist, AndNode *node, bool area_flow2=false)
 		{
 			depth = 0;
 			cut_width = 0;
@@ -1336,7 +2921,7 @@ struct Network {
 			}
 
 			if (area_flow2) {
-				area_flow = compute_area_flow(cutlist, node);
+				area_flow = compute_area_flow(net, cutlist, node);
 			} else {
 				area_flow = lib.lookup(cutlist.size).cost;
 				for (auto cut_node : cutlist)
@@ -1350,47 +2935,50 @@ struct Network {
 			edge_flow /= std::max(1, node->map_fanouts);
 		}
 
-		static int compute_area_flow(CutList cutlist, AndNode *node, bool top=true)
+		// Area flow of the cut, descending through leaves which aren't
+		// part of the mapping. Depth-first with an explicit stack.
+		static int compute_area_flow(Network &net, CutList cutlist, AndNode *node)
 		{
-			int area_flow = 100;
-
-			if (node->visited || node->pi)
+			struct Frame {
+				AndNode *node;
+				CutList cutlist;
+				int pos;
+				int area_flow;
+			};
+			std::vector<Frame> stack;
+
+			net.begin_traversal();
+			if (node->pi)
 				return 0;
+			net.visit(node);
+			stack.push_back({node, cutlist, 0, 100});
+
+			while (true) {
+				Frame &top = stack.back();
+
+				if (top.pos == top.cutlist.size) {
+					int area_flow = top.area_flow / std::max(1, top.node->map_fanouts);
+					stack.pop_back();
+					if (stack.empty())
+						return area_flow;
+					stack.back().area_flow += area_flow;
+					continue;
+				}
 
-			node->visited = true;
-
-			for (auto cut_node : cutlist) {
-				if (cut_node.img->visited)
+				AndNode *leaf = net.arena[top.cutlist.lit(top.pos++).id()];
+				if (net.visited(leaf))
 					continue;
 
-				if (!cut_node.img->map_fanouts) {
-					area_flow += compute_area_flow(CutList{cut_node.img->cut}, cut_node.img, false);
+				if (!leaf->map_fanouts) {
+					if (leaf->pi)
+						continue;
+					net.visit(leaf);
+					stack.push_back({leaf, net.cutlist(leaf), 0, 100});
 				} else {
-					cut_node.img->visited = true;
-					area_flow += cut_node.img->area_flow;
+					net.visit(leaf);
+					top.area_flow += leaf->area_flow;
 				}
 			}
-			area_flow /= std::max(1, node->map_fanouts);
-
-			if (top)
-				clear_area_flow_visited(cutlist, node);
-
-			return area_flow;
-		}
-
-		static void clear_area_flow_visited(CutList cutlist, AndNode *node)
-		{
-			if (!node->visited || node->pi)
-				return;
-
-			for (auto cut_node : cutlist) {
-				if (!cut_node.img->map_fanouts)
-					clear_area_flow_visited(CutList{cut_node.img->cut}, cut_node.img);
-				else
-					cut_node.img->visited = false;
-			}
-
-			node->visited = false;
 		}
 
 		bool operator<(const DepthEval other) const
@@ -1405,8 +2993,8 @@ struct Network {
 	};
 
 	struct DepthEvalInitial : public DepthEval {
-		DepthEvalInitial(LutLibrary &lib, CutList cutlist, AndNode *node)
-			: DepthEval(lib, cutlist, node, false)
+		DepthEvalInitial(Network &net, LutLibrary &lib, CutList cutlist, AndNode *node)
+			: DepthEval(net, lib, cutlist, node, false)
 		{
 			area_flow = lib.lookup(cutlist.size).cost;;
 			for (auto cut_node : cutlist)
@@ -1422,8 +3010,8 @@ struct Network {
 	};
 
 	struct DepthEvalInitial2 : public DepthEvalInitial {
-		DepthEvalInitial2(LutLibrary &lib, CutList cutlist, AndNode *node)
-				: DepthEvalInitial(lib, cutlist, node) {}
+		DepthEvalInitial2(Network &net, LutLibrary &lib, CutList cutlist, AndNode *node)
+				: DepthEvalInitial(net, lib, cutlist, node) {}
 		bool operator<(const DepthEvalInitial2 other) const
 			{ return std::tie(depth, area_flow, edge_flow, cut_width)
 						< std::tie(other.depth, other.area_flow, other.edge_flow, other.cut_width); }
@@ -1432,8 +3020,8 @@ struct Network {
 	};
 
 	struct AreaEvalInitial : public DepthEvalInitial {
-		AreaEvalInitial(LutLibrary &lib, CutList cutlist, AndNode *node)
-				: DepthEvalInitial(lib, cutlist, node) {}
+		AreaEvalInitial(Network &net, LutLibrary &lib, CutList cutlist, AndNode *node)
+				: DepthEvalInitial(net, lib, cutlist, node) {}
 		bool operator<(const AreaEvalInitial other) const
 			{ return std::tie(area_flow, edge_flow, cut_width, depth)
 						< std::tie(other.area_flow, other.edge_flow, other.cut_width, other.depth); }
@@ -1443,8 +3031,8 @@ struct Network {
 
 	struct AreaFlowEval : public DepthEval {
 		int fanin_refs;
-		AreaFlowEval(LutLibrary &lib, CutList cutlist, AndNode *node)
-				: DepthEval(lib, cutlist, node) {}
+		AreaFlowEval(Network &net, LutLibrary &lib, CutList cutlist, AndNode *node)
+				: DepthEval(net, lib, cutlist, node) {}
 		bool operator<(const AreaFlowEval other) const
 			{ return std::tie(area_flow, edge_flow, cut_width, depth)
 						< std::tie(other.area_flow, other.edge_flow, other.cut_width, other.depth); }
@@ -1454,46 +3042,33 @@ struct Network {
 
 	struct ExactAreaEval : public AreaFlowEval {
 		int exact_area;
-		ExactAreaEval(LutLibrary &lib, CutList cutlist, AndNode *node)
-				: AreaFlowEval(lib, cutlist, node) {
-			exact_area = calc_exact_area(lib, cutlist, node);
+		ExactAreaEval(Network &net, LutLibrary &lib, CutList cutlist, AndNode *node)
+				: AreaFlowEval(net, lib, cutlist, node) {
+			exact_area = calc_exact_area(net, lib, cutlist, node);
 		}
-
-		static int ref_cut(LutLibrary &lib, AndNode *node)
-		{
-			if (node->pi)
-				return 0;
-
-			CutList cutlist(node->cut);
-			int sum = lib.lookup(cutlist.size).cost;
-			for (auto cut_node : cutlist) {
-				log_assert(cut_node.img != node);
-				if (!cut_node.img->map_fanouts++)
-					sum += ref_cut(lib, cut_node.img);
-				log_assert(cut_node.img->map_fanouts >= 1);
-			}
-			return sum;
+		ExactAreaEval(Network &net, LutLibrary &lib, CutList cutlist, AndNode *node,
+					  RefOverlay &overlay)
+				: AreaFlowEval(net, lib, cutlist, node) {
+			exact_area = node->pi ? 0 : net.overlay_cut_area(lib, cutlist, overlay);
 		}
 
-		static int calc_exact_area(LutLibrary &lib, CutList cutlist, AndNode *node) {
+		static const bool detach_cut = true;
+		static const bool level_parallel = false;
+		static const bool speculative = true;
+
+		// Expects the node's current cut to be dereferenced (see detach_cut)
+		static int calc_exact_area(Network &net, LutLibrary &lib, CutList cutlist, AndNode *node) {
 			if (node->pi)
 				return 0;
-			int ret;
 
-			if (node->map_fanouts)
-				deref_cut(node);
-
-			ret = lib.lookup(cutlist.size).cost;
+			int ret = lib.lookup(cutlist.size).cost;
 			for (auto cut_node : cutlist)
 			if (!cut_node.img->map_fanouts++)
-				ret += ref_cut(lib, cut_node.img);
+				ret += net.ref_cut(cut_node.img, &lib).area;
 
 			for (auto cut_node : cutlist)
 			if (!--cut_node.img->map_fanouts)
-				deref_cut(cut_node.img);
-
-			if (node->map_fanouts)
-				ref_cut(lib, node);
+				net.deref_cut(cut_node.img);
 
 			return ret;
 		}
@@ -1509,10 +3084,12 @@ struct Network {
 	void spread_depth_limit(int overall_depth)
 	{
 		for (auto node : nodes)
-			node->depth_limit = node->po ? overall_depth + 1
-									: std::numeric_limits<int>::max();
+		if (node->po)
+			node->depth_limit = po_limits.data.empty() ? overall_depth + 1 : po_limits[node];
+		else
+			node->depth_limit = std::numeric_limits<int>::max();
 		for (auto it = nodes.rbegin(); it != nodes.rend(); it++) {
-			for (auto cut_fanin : CutList{(*it)->cut})
+			for (auto cut_fanin : cutlist(*it))
 				cut_fanin.img->depth_limit =
 						std::min(cut_fanin.img->depth_limit,
 						 		 (*it)->depth_limit - 1);
@@ -1532,7 +3109,19 @@ struct Network {
 		}
 	}
 
-	void depth_cuts(LutLibrary &lib)
+	// Depth of the mapping, in LUTs on the longest path
+	int mapping_depth()
+	{
+		int depth = 0;
+		for (auto node : nodes)
+		if (node->po)
+		for (auto fanin : node->fanins())
+			depth = std::max(depth, fanin->depth);
+		return depth;
+	}
+
+	// Set up for a sequence of cuts<> passes
+	void prepare_cuts(LutLibrary &lib)
 	{
 		// We don't support non-unit delays for now
 		for (auto &v : lib.varieties)
@@ -1540,31 +3129,71 @@ struct Network {
 			log_assert(d == 1);
 
 		tsort();
+		level_order.clear();
+		level_bounds.clear();
+		level_frontier_size = 0;
 		frontier();
+		if (threads > 1)
+			level_frontier();
+		{
+			int max_cut = std::min(lib.max_width(), CUT_MAXIMUM);
+			size_t nsets = reuse_cuts ? arena.id_bound()
+							: std::max(frontier_size, level_frontier_size);
+			nlog("Cut cache takes %zu bytes (%zu per node)\n",
+				nsets * cut_set_bytes(max_cut), cut_set_bytes(max_cut));
+		}
 		fanouts();
+		drop_vacuous = !has_initvals();
 
 		for (auto node : nodes) {
-			node->depth = 0;
+			node->depth = (node->pi && !arrivals.data.empty()) ? arrivals[node] : 0;
 			node->area_flow = 0;
 			node->edge_flow = 0;
 			node->map_fanouts = 0;
-			node->visited = false;
 			node->depth_limit = std::numeric_limits<int>::max();
 		}
+		cut_store.reset();
+	}
+
+	void depth_cuts(LutLibrary &lib, const CutSchedule &schedule=CutSchedule())
+	{
+		if (partition_size && (int) nodes.size() > 2 * partition_size) {
+			partitioned_cuts(lib, schedule);
+			return;
+		}
 
+		prepare_cuts(lib);
 		cuts<DepthEvalInitial>(lib, false);
+		area_cuts(lib, schedule);
+	}
 
-		int target_depth = 0;
-		for (auto node : nodes)
-		if (node->po)
-		for (auto fanin : node->fanins())
-			target_depth = std::max(target_depth, fanin->depth);
-		log("Mapping: Depth will be %d\n", target_depth);
-		spread_depth_limit(target_depth);
+	// The passes of depth_cuts() after the initial depth-optimal one
+	void area_cuts(LutLibrary &lib, const CutSchedule &schedule)
+	{
+		int target_depth = mapping_depth() + schedule.depth_slack;
+		nlog("Mapping: Depth will be %d\n", target_depth);
 
-		cuts<DepthEvalInitial2>(lib, false, true);
+		// POs with a depth required of them which the depth pass couldn't
+		// meet are held to what it achieved instead
+		if (!po_limits.data.empty()) {
+			int nmissed = 0;
+			for (auto node : nodes)
+			if (node->po)
+			for (auto fanin : node->fanins())
+			if (fanin->depth + 1 > po_limits[node]) {
+				po_limits[node] = fanin->depth + 1;
+				nmissed++;
+			}
+			if (nmissed)
+				nlog("Mapping: Missed the required depth on %d POs\n", nmissed);
+		}
 		spread_depth_limit(target_depth);
 
+		if (schedule.redo_depth) {
+			cuts<DepthEvalInitial2>(lib, false, true);
+			spread_depth_limit(target_depth);
+		}
+
 		cuts<AreaEvalInitial>(lib, false, true);
 		spread_depth_limit(target_depth);
 
@@ -1575,30 +3204,549 @@ struct Network {
 		// reference counts if the selected cut on a node that is part of the mapping changes.
 		walk_mapping(lib);
 
-		log("Mapping: Performing area recovery\n");
+		nlog("Mapping: Performing area recovery\n");
 
-		spread_depth_limit(target_depth);
-		cuts<AreaFlowEval>(lib);
-		spread_depth_limit(target_depth);
-		cuts<ExactAreaEval>(lib);
-		spread_depth_limit(target_depth);
-		cuts<ExactAreaEval>(lib);
+		for (int i = 0; i < schedule.area_flow_rounds; i++) {
+			spread_depth_limit(target_depth);
+			cuts<AreaFlowEval>(lib);
+		}
+		for (int i = 0; i < schedule.exact_area_rounds; i++) {
+			spread_depth_limit(target_depth);
+			cuts<ExactAreaEval>(lib);
+		}
 
 		// Walk the mapping once more to (1) check the `map_fanouts` counters for consistence;
 		// and (2) print out the final mapping area.
 		walk_mapping(lib, true);
+		cut_store.reset();
+		level_order.clear();
+		level_bounds.clear();
+	}
+
+	// Copy the nodes `members` of window `w` out into `net`, with the ID
+	// of each node's original in `orig_ids`. Fanins in other windows
+	// become PIs arriving at their depths. Members that are POs stay POs,
+	// and those marked in `outputs` get an extra PO each, with no depth
+	// limits set on either.
+	void copy_window(Network &net, std::vector<uint32_t> &orig_ids, int w,
+					 const std::vector<AndNode*> &members, NodeData<int> &window_of,
+					 NodeData<char> &outputs, NodeData<uint32_t> &local_ids)
+	{
+		net.cut_budget = cut_budget;
+		net.reuse_cuts = reuse_cuts;
+		net.threads = threads;
+
+		auto add = [&](uint32_t orig_id) {
+			AndNode *node = net.add_node();
+			if (node->id >= orig_ids.size())
+				orig_ids.resize(node->id + 1, (uint32_t) Lit::CONST_ID);
+			orig_ids[node->id] = orig_id;
+			return node;
+		};
+
+		// POs count as arriving at zero as they do within cuts<>
+		Yosys::dict<uint32_t, AndNode*> inputs;
+		auto local = [&](AndNode *node) {
+			if (window_of[node] == w)
+				return net.arena[local_ids[node]];
+			if (!inputs.count(node->id)) {
+				AndNode *input = add(node->id);
+				input->pi = true;
+				net.arrivals[input] = (node->pi || node->po) ? 0 : node->depth;
+				inputs[node->id] = input;
+			}
+			return inputs.at(node->id);
+		};
+
+		for (auto node : members) {
+			AndNode *copy = add(node->id);
+			local_ids[node] = copy->id;
+			copy->po = node->po;
+			for (int i = 0; i < 2; i++) {
+				copy->ins[i] = node->ins[i];
+				if (node->ins[i].node)
+					copy->ins[i].node = local(node->ins[i].node);
+			}
+
+			if (outputs[node] && !node->po) {
+				AndNode *output = add(Lit::CONST_ID);
+				output->po = true;
+				output->ins[0].set_node(copy);
+				output->ins[1].set_const(1);
+			}
+		}
+	}
+
+	// Copy the cuts selected in a window back onto the nodes of the
+	// network
+	void copy_window_cuts(Network &net, const std::vector<uint32_t> &orig_ids)
+	{
+		for (auto copy : net.nodes) {
+			uint32_t orig_id = orig_ids[copy->id];
+			if (copy->pi || orig_id == Lit::CONST_ID)
+				continue;
+			AndNode *node = arena[orig_id];
+			Lit *cut = selected_cut(node);
+			for (auto cut_node : net.cutlist(copy))
+				*cut++ = Lit::make(orig_ids[cut_node.img->id], cut_node.lag);
+			*cut = Lit::null();
+			std::copy(net.selected_tt(copy), net.selected_tt(copy) + tt_words,
+					  selected_tt(node));
+			node->area_flow = copy->area_flow;
+			node->edge_flow = copy->edge_flow;
+		}
+	}
+
+	// Depths of the nodes after the selected cuts, and the depth of the
+	// whole mapping
+	int stitched_depth()
+	{
+		for (auto node : nodes) {
+			node->depth = 0;
+			if (node->pi || node->po)
+				continue;
+			for (auto cut_node : cutlist(node))
+				node->depth = std::max(node->depth, cut_node.img->depth + 1);
+		}
+		return mapping_depth();
+	}
+
+	// Map the network by windows of about `partition_size` nodes, each
+	// copied out into a network of its own.
+	//
+	// The depth pass runs over the whole network first, and the windows
+	// are bands of the depths it gives the nodes. Their inputs arrive at
+	// those depths and their outputs are held to them while the windows
+	// get their own depth and area passes, concurrently. Wherever a
+	// window's cuts still come out deeper than needed, the depth pass's
+	// cuts are taken instead, so the depth is what it is without
+	// partitioning. Bands of a few levels around each boundary between
+	// windows are then remapped the same way for cuts across the
+	// boundaries, where that saves area.
+	void partitioned_cuts(LutLibrary &lib, const CutSchedule &schedule)
+	{
+		// Levels within a band around each window boundary
+		const int seam_levels = 3;
+
+		// A part of the network copied out into a network of its own
+		struct Window {
+			Network net;
+			std::vector<uint32_t> orig_ids;
+			std::vector<LogEntry> log;
+
+			void copy_back(Network &whole)
+			{
+				whole.copy_window_cuts(net, orig_ids);
+				for (auto &entry : log)
+				if (entry.warning)
+					whole.nlog_warning("%s", entry.text.c_str());
+			}
+		};
+
+		prepare_cuts(lib);
+		cuts<DepthEvalInitial>(lib, false);
+
+		// Depths after the cuts as stitched together, which is how they
+		// are checked once the windows are back
+		int target_depth = stitched_depth() + schedule.depth_slack;
+
+		// Windows are bands of the depths the nodes reach, each node taken
+		// to be at least as deep as its fanins
+		NodeData<int> level(arena, 0);
+		std::vector<int> level_sizes;
+		for (auto node : nodes) {
+			if (node->pi)
+				continue;
+			level[node] = node->depth;
+			for (auto fanin : node->fanins())
+				level[node] = std::max(level[node], level[fanin]);
+			if (level[node] >= (int) level_sizes.size())
+				level_sizes.resize(level[node] + 1);
+			level_sizes[level[node]]++;
+		}
+
+		std::vector<int> level_window(level_sizes.size());
+		std::vector<int> window_starts;
+		int fill = 0;
+		for (int l = 0; l < (int) level_sizes.size(); l++) {
+			if (window_starts.empty() || fill >= partition_size) {
+				window_starts.push_back(l);
+				fill = 0;
+			}
+			level_window[l] = window_starts.size() - 1;
+			fill += level_sizes[l];
+		}
+		int nwindows = window_starts.size();
+		window_starts.push_back(level_sizes.size());
+
+		if (nwindows < 2) {
+			area_cuts(lib, schedule);
+			return;
+		}
+		cut_store.reset();
+		level_order.clear();
+		level_bounds.clear();
+		nlog("Mapping: Depth will be %d\n", target_depth);
+
+		NodeData<int> window_of(arena, -1);
+		std::vector<std::vector<AndNode*>> members(nwindows);
+		for (auto node : nodes)
+		if (!node->pi) {
+			window_of[node] = level_window[level[node]];
+			members[window_of[node]].push_back(node);
+		}
+
+		NodeData<char> outputs(arena, false);
+		int nboundary = 0;
+		for (auto node : nodes)
+		for (auto fanin : node->fanins())
+		if (!fanin->pi && window_of[fanin] != window_of[node] && !outputs[fanin]) {
+			outputs[fanin] = true;
+			nboundary++;
+		}
+		nlog("Partition: %d windows, %d nodes on window boundaries\n",
+			 nwindows, nboundary);
+
+		std::vector<Window> parts(nwindows);
+		NodeData<uint32_t> local_ids(arena, 0);
+		for (int w = 0; w < nwindows; w++) {
+			Window &part = parts[w];
+			part.net.log_buffer = &part.log;
+			copy_window(part.net, part.orig_ids, w, members[w], window_of, outputs, local_ids);
+		}
+
+		thread_pool().parallel_for(nwindows, [&](int w) {
+			Network &net = parts[w].net;
+			net.prepare_cuts(lib);
+			net.cuts<DepthEvalInitial>(lib, false);
+			for (auto node : net.nodes)
+			if (node->po)
+			for (auto fanin : node->fanins()) {
+				uint32_t orig_id = parts[w].orig_ids[node->id];
+				net.po_limits[node] = orig_id == Lit::CONST_ID
+								? arena[parts[w].orig_ids[fanin->id]]->depth + 1
+								: target_depth + 1;
+			}
+			net.area_cuts(lib, schedule);
+		});
+
+		set_cut_width(parts.front().net.cut_width);
+		std::vector<Lit> depth_pass_leaves = cut_leaves;
+		std::vector<u64> depth_pass_tts = cut_tts;
+		for (auto &part : parts)
+			part.copy_back(*this);
+		parts.clear();
+
+		// Each node has the cut from its window and the one from the depth
+		// pass to choose from. Going up, a node's depth is first taken to
+		// be the least it can get with either, which is no more than what
+		// the depth pass got.
+		size_t stride = cut_width + 1;
+		auto depth_pass_cut = [&](AndNode *node) {
+			return CutList(arena, &depth_pass_leaves[node->id * stride]);
+		};
+		auto cut_depth = [&](CutList cut) {
+			int depth = 0;
+			for (auto cut_node : cut)
+				depth = std::max(depth, cut_node.img->depth + 1);
+			return depth;
+		};
+		for (auto node : nodes) {
+			node->depth = 0;
+			if (!node->pi && !node->po)
+				node->depth = std::min(cut_depth(cutlist(node)), cut_depth(depth_pass_cut(node)));
+		}
+
+		// Going down from the POs, a node needed at some depth keeps its
+		// window's cut if that can meet it, and takes the depth pass's cut
+		// otherwise. The leaves are then needed a level below.
+		NodeData<int> required(arena, std::numeric_limits<int>::max());
+		NodeData<char> needed(arena, false);
+		int nfallbacks = 0;
+		for (auto it = nodes.rbegin(); it != nodes.rend(); it++) {
+			AndNode *node = *it;
+			if (node->po) {
+				needed[node] = true;
+				required[node] = target_depth + 1;
+			}
+			if (!needed[node] || node->pi)
+				continue;
+			if (cut_depth(cutlist(node)) > required[node]) {
+				std::copy(&depth_pass_leaves[node->id * stride],
+						  &depth_pass_leaves[(node->id + 1) * stride], selected_cut(node));
+				std::copy(&depth_pass_tts[node->id * tt_words],
+						  &depth_pass_tts[(node->id + 1) * tt_words], selected_tt(node));
+				nfallbacks++;
+			}
+			for (auto cut_node : cutlist(node)) {
+				needed[cut_node.img] = true;
+				required[cut_node.img] = std::min(required[cut_node.img], required[node] - 1);
+			}
+		}
+		if (nfallbacks)
+			nlog("Partition: %d nodes took the cuts of the depth pass\n", nfallbacks);
+		int depth = stitched_depth();
+		log_assert(depth <= target_depth);
+		for (auto node : nodes)
+			node->map_fanouts = 0;
+		int area = walk_mapping(lib);
+		nlog("Partition: Windows mapped with area %d and depth %d\n", area, depth);
+
+		// Bands around the window boundaries, reaching at most halfway
+		// into the windows on either side so that they stay apart
+		int nseams = nwindows - 1;
+		NodeData<int> seam_of(arena, -1);
+		std::vector<std::vector<AndNode*>> seam_members(nseams);
+		for (auto node : nodes)
+		if (!node->pi && !node->po) {
+			int w = window_of[node], l = level[node];
+			int s = -1;
+			if (w > 0 && l < std::min(window_starts[w] + seam_levels,
+									  (window_starts[w] + window_starts[w + 1]) / 2))
+				s = w - 1;
+			if (w + 1 < nwindows && l >= std::max(window_starts[w + 1] - seam_levels,
+												  (window_starts[w] + window_starts[w + 1]) / 2))
+				s = w;
+			if (s != -1) {
+				seam_of[node] = s;
+				seam_members[s].push_back(node);
+			}
+		}
+
+		// A band also takes in the cones of its nodes' cuts reaching below
+		// it, so that it can keep the LUTs it has now. With leaves found
+		// vacuous dropped from the cuts, a cone is only followed down to
+		// the lowest level of the cut's leaves, levels not decreasing
+		// along the paths to them.
+		for (int s = 0; s < nseams; s++) {
+			std::vector<AndNode*> stack;
+			begin_traversal();
+			for (auto node : seam_members[s]) {
+				CutList cut = cutlist(node);
+				int floor = level[node];
+				for (auto cut_node : cut)
+					floor = std::min(floor, level[cut_node.img]);
+				stack.push_back(node);
+				while (!stack.empty()) {
+					AndNode *top = stack.back();
+					stack.pop_back();
+					for (auto fanin : top->fanins()) {
+						bool leaf = false;
+						for (auto cut_node : cut)
+							leaf |= cut_node.img == fanin;
+						if (leaf || fanin->pi || fanin->po || visited(fanin)
+								|| level[fanin] < floor)
+							continue;
+						visit(fanin);
+						if (seam_of[fanin] == -1)
+							seam_of[fanin] = s;
+						if (seam_of[fanin] == s)
+							stack.push_back(fanin);
+					}
+				}
+			}
+		}
+		for (auto &band : seam_members)
+			band.clear();
+		for (auto node : nodes)
+		if (seam_of[node] != -1)
+			seam_members[seam_of[node]].push_back(node);
+
+		// A band keeps as outputs those of its nodes the mapping outside
+		// refers to or may come to refer to once its inputs are mapped,
+		// and those other bands read
+		NodeData<char> seam_outputs(arena, false), seam_input(arena, false);
+		for (auto node : nodes)
+		if (seam_of[node] != -1)
+		for (auto fanin : node->fanins())
+			seam_input[fanin] = seam_of[fanin] != seam_of[node];
+		for (auto node : nodes) {
+			if (node->pi)
+				continue;
+			if ((node->map_fanouts || seam_input[node]) && seam_of[node] == -1)
+			for (auto cut_node : cutlist(node))
+			if (seam_of[cut_node.img] != -1)
+				seam_outputs[cut_node.img] = true;
+			if (seam_of[node] != -1)
+			for (auto fanin : node->fanins())
+			if (seam_of[fanin] != -1 && seam_of[fanin] != seam_of[node])
+				seam_outputs[fanin] = true;
+		}
+
+		// The bands are mapped afresh, their outputs held to the depths
+		// they have in the mapping of the windows. A band's mapping is
+		// taken if it meets those depths and costs less than the LUTs it
+		// replaces, counting in any inputs it newly needs mapped.
+		std::vector<Window> seams(nseams);
+		std::vector<char> improved(nseams, false);
+		thread_pool().parallel_for(nseams, [&](int s) {
+			if (seam_members[s].empty())
+				return;
+			Window &seam = seams[s];
+			seam.net.log_buffer = &seam.log;
+			copy_window(seam.net, seam.orig_ids, s, seam_members[s], seam_of, seam_outputs, local_ids);
+			Network &net = seam.net;
+			for (auto node : net.nodes)
+			if (node->po)
+			for (auto fanin : node->fanins())
+				net.po_limits[node] = arena[seam.orig_ids[fanin->id]]->depth + 1;
+			NodeData<int> required = net.po_limits;
+			net.depth_cuts(lib, schedule);
+
+			int old_cost = 0, new_cost = net.walk_mapping(lib);
+			for (auto node : seam_members[s])
+			if (node->map_fanouts)
+				old_cost += lib.lookup(cutlist(node).size).cost;
+			bool met = true;
+			for (auto node : net.nodes) {
+				AndNode *orig = seam.orig_ids[node->id] == Lit::CONST_ID
+								? nullptr : arena[seam.orig_ids[node->id]];
+				if (node->po)
+				for (auto fanin : node->fanins())
+					met &= fanin->depth + 1 <= required[node];
+				if (node->pi && node->map_fanouts && !orig->map_fanouts
+						&& !orig->pi && !orig->po)
+					new_cost += lib.lookup(cutlist(orig).size).cost;
+			}
+			improved[s] = met && new_cost < old_cost;
+		});
+
+		// Keep the bands' mapping unless it came out larger all the same
+		std::vector<Lit> old_leaves = cut_leaves;
+		std::vector<u64> old_tts = cut_tts;
+		int nimproved = 0;
+		for (int s = 0; s < nseams; s++)
+		if (improved[s]) {
+			seams[s].copy_back(*this);
+			nimproved++;
+		}
+		seams.clear();
+		int refined_depth = stitched_depth();
+		for (auto node : nodes)
+			node->map_fanouts = 0;
+		int refined_area = walk_mapping(lib);
+		if (refined_area > area || refined_depth > depth) {
+			cut_leaves.swap(old_leaves);
+			cut_tts.swap(old_tts);
+			stitched_depth();
+			for (auto node : nodes)
+				node->map_fanouts = 0;
+			nlog("Partition: Kept the windows' mapping over one with area %d\n", refined_area);
+		} else {
+			nlog("Partition: Remapped %d of %d bands across window boundaries, area %d\n",
+				 nimproved, nseams, refined_area);
+		}
+
+		walk_mapping(lib, true);
+	}
+
+	// Run depth_cuts() with each of several schedules on a copy of the
+	// network, the copies on separate threads, and keep the best mapping:
+	// the smallest one, or with `depth_first` the shallowest one, the other
+	// measure breaking ties. Only the kept mapping's log is printed.
+	void portfolio_cuts(LutLibrary &lib, bool depth_first)
+	{
+		std::vector<CutSchedule> schedules(4);
+		schedules[1].name = "direct";
+		schedules[1].redo_depth = false;
+		schedules[2].name = "extended";
+		schedules[2].area_flow_rounds = 2;
+		schedules[2].exact_area_rounds = 3;
+		schedules[3].name = "relaxed";
+		schedules[3].depth_slack = 1;
+		int n = schedules.size();
+
+		std::vector<Network> runs;
+		std::vector<std::vector<LogEntry>> logs(n);
+		for (int i = 0; i < n; i++) {
+			runs.push_back(copy());
+			runs[i].log_buffer = &logs[i];
+		}
+
+		std::vector<int> areas(n), depths(n);
+		thread_pool().parallel_for(n, [&](int i) {
+			runs[i].depth_cuts(lib, schedules[i]);
+			areas[i] = runs[i].walk_mapping(lib);
+			depths[i] = runs[i].mapping_depth();
+		});
+
+		int best = 0;
+		for (int i = 1; i < n; i++) {
+			auto key = [&](int k) {
+				return depth_first ? std::make_pair(depths[k], areas[k])
+								   : std::make_pair(areas[k], depths[k]);
+			};
+			if (key(i) < key(best))
+				best = i;
+		}
+
+		for (auto &entry : logs[best]) {
+			if (entry.warning)
+				nlog_warning("%s", entry.text.c_str());
+			else
+				nlog("%s", entry.text.c_str());
+		}
+		for (int i = 0; i < n; i++)
+			nlog("Portfolio: %-8s area %6d depth %4d%s\n", schedules[i].name,
+				 areas[i], depths[i], i == best ? " (kept)" : "");
+
+		std::vector<LogEntry> *buffer = log_buffer;
+		int nthreads = threads;
+		*this = std::move(runs[best]);
+		log_buffer = buffer;
+		threads = nthreads;
 	}
 
 	void dump_cuts()
 	{
 		for (auto node : nodes) {
 			if (node->pi) {
-				log("Node %s: PI\n", node->label.c_str());
+				nlog("Node %s: PI\n", labels[node].c_str());
+				continue;
+			}
+			nlog("Node %s: (depth %d)\n", labels[node].c_str(), node->depth);
+			for (auto cut_node : cutlist(node))
+				nlog("\t%s (lag %d)\n", labels[cut_node.img].c_str(), cut_node.lag);
+		}
+	}
+
+	bool has_initvals()
+	{
+		for (auto node : nodes)
+		if (!node->pi)
+		for (auto &in : node->ins)
+		if (!in.feat.initvals_undef())
+			return true;
+		return false;
+	}
+
+	// Registers on the cut leaves are emitted without initial values, so
+	// none of the edges inside the cut's cone may carry any. Cuts keep
+	// their vacuous leaves whenever there are initial values around (see
+	// `drop_vacuous`), so the leaves bound the walk.
+	void check_cut_initvals(AndNode *node)
+	{
+		CutList cut = cutlist(node);
+		std::vector<CoverNode> stack = {CoverNode{0, node}};
+		begin_traversal();
+		while (!stack.empty()) {
+			CoverNode top = stack.back();
+			stack.pop_back();
+			if (top.img->pi)
 				continue;
+			for (auto &in : top.img->ins) {
+				log_assert(in.feat.initvals_undef());
+				if (!in.node || visited(in.node))
+					continue;
+				CoverNode fanin{top.lag + in.feat.lag, in.node};
+				bool leaf = false;
+				for (auto cut_node : cut)
+					leaf |= cut_node == fanin;
+				if (!leaf) {
+					visit(in.node);
+					stack.push_back(fanin);
+				}
 			}
-			log("Node %s: (depth %d)\n", node->label.c_str(), node->depth);
-			for (auto cut_node : CutList{node->cut})
-				log("\t%s (lag %d)\n", cut_node.img->label.c_str(), cut_node.lag);
 		}
 	}
 
@@ -1606,13 +3754,16 @@ struct Network {
 	{
 		yosys_perimeter(m);
 		yosys_wires(m, true);
+		bool check_initvals = has_initvals();
 
 		for (auto node : nodes) {
 			if (!node->map_fanouts || node->pi)
 				continue;
+			if (check_initvals)
+				check_cut_initvals(node);
 			RTLIL::SigSpec yin;
-			for (auto cut_node : CutList{node->cut, 0}) {
-				RTLIL::SigBit ybit = cut_node.img->yw;
+			for (auto cut_node : cutlist(node)) {
+				RTLIL::SigBit ybit = ywires[cut_node.img];
 				log_assert(cut_node.lag >= 0);
 				for (int i = 0; i < cut_node.lag; i++) {
 					RTLIL::SigBit q = m->addWire(NEW_ID, 1);
@@ -1622,14 +3773,14 @@ struct Network {
 				yin.append(ybit);
 			}
 
+			std::vector<bool> tt = tt_bits(selected_tt(node), yin.size());
+
 			if (yin.size() == 0) {
-				m->connect(node->yw, RTLIL::SigBit(node->truth_table()[0]));
+				m->connect(ywires[node], RTLIL::SigBit(tt[0]));
 				continue;
 			}
 
 			if (gate2 && yin.size() == 2) {
-				auto tt = node->truth_table();
-
 				if (!tt[2] && tt[1]) {
 					std::swap(tt[2], tt[1]);
 					std::swap(yin[1], yin[0]);
@@ -1637,52 +3788,57 @@ struct Network {
 
 				switch ((tt[3] << 3) | (tt[2] << 2) | (tt[1] << 1) | tt[0]) {
 					case 0b1111:
-						m->connect(node->yw, RTLIL::State::S1); continue;
+						m->connect(ywires[node], RTLIL::State::S1); continue;
 					case 0b1110:
-						m->addOrGate(NEW_ID, yin[0], yin[1], node->yw); continue;
+						m->addOrGate(NEW_ID, yin[0], yin[1], ywires[node]); continue;
 					case 0b1101:
-						m->addOrnotGate(NEW_ID, yin[1], yin[0], node->yw); continue;
+						m->addOrnotGate(NEW_ID, yin[1], yin[0], ywires[node]); continue;
 					case 0b1100:
-						m->connect(node->yw, yin[1]); continue;
+						m->connect(ywires[node], yin[1]); continue;
 					case 0b1001:
-						m->addXnorGate(NEW_ID, yin[0], yin[1], node->yw); continue;
+						m->addXnorGate(NEW_ID, yin[0], yin[1], ywires[node]); continue;
 					case 0b1000:
-						m->addAndGate(NEW_ID, yin[0], yin[1], node->yw); continue;
+						m->addAndGate(NEW_ID, yin[0], yin[1], ywires[node]); continue;
 					case 0b0111:
-						m->addNandGate(NEW_ID, yin[0], yin[1], node->yw); continue;
+						m->addNandGate(NEW_ID, yin[0], yin[1], ywires[node]); continue;
 					case 0b0110:
-						m->addXorGate(NEW_ID, yin[0], yin[1], node->yw); continue;
+						m->addXorGate(NEW_ID, yin[0], yin[1], ywires[node]); continue;
 					case 0b0101:
-						m->addNotGate(NEW_ID, yin[0], node->yw); continue;
+						m->addNotGate(NEW_ID, yin[0], ywires[node]); continue;
 					case 0b0100:
-						m->addAndnotGate(NEW_ID, yin[1], yin[0], node->yw); continue;
+						m->addAndnotGate(NEW_ID, yin[1], yin[0], ywires[node]); continue;
 					case 0b0001:
-						m->addNorGate(NEW_ID, yin[0], yin[1], node->yw); continue;
+						m->addNorGate(NEW_ID, yin[0], yin[1], ywires[node]); continue;
 					case 0b0000:
-						m->connect(node->yw, RTLIL::State::S0); continue;
+						m->connect(ywires[node], RTLIL::State::S0); continue;
 				}
 				log_assert(false && "unreachable");
 			}
 
 			if (yin.size() > 1) {
-				m->addLut(NEW_ID, yin, node->yw, node->truth_table());
+				m->addLut(NEW_ID, yin, ywires[node], tt);
 				continue;
 			}
 
+			// A single-input cut is charged as a LUT during mapping, so an
+			// inverter is emitted as one too, unless mapping to gates.
+			// lutnot absorbs it into the driving LUT where it can.
 			log_assert(yin.size() == 1);
-			auto tt = node->truth_table();
 			switch (tt[1] << 1 | tt[0]) {
 			case 0b00:
-				m->connect(node->yw, RTLIL::State::S0);
+				m->connect(ywires[node], RTLIL::State::S0);
 				break;
 			case 0b10:
-				m->connect(node->yw, yin);
+				m->connect(ywires[node], yin);
 				break;
 			case 0b01:
-				m->addNotGate(NEW_ID, yin[0], node->yw);
+				if (gate2)
+					m->addNotGate(NEW_ID, yin[0], ywires[node]);
+				else
+					m->addLut(NEW_ID, yin, ywires[node], tt);
 				break;
 			case 0b11:
-				m->connect(node->yw, RTLIL::State::S0);
+				m->connect(ywires[node], RTLIL::State::S1);
 				break;
 			}
 		}
@@ -1690,6 +3846,25 @@ struct Network {
 };
 
 USING_YOSYS_NAMESPACE
+// A module being worked on by ToymapPass
+struct ModuleJob {
+	RTLIL::Module *module = nullptr;
+
+	// Once forked for several LUT arities, one network per arity mapped
+	// into `targets[i]`. The copies of the module are made when the
+	// module is next worked on serially, until then they're null.
+	std::vector<Network> nets;
+	std::vector<RTLIL::Module *> targets;
+	bool forked = false;
+	bool emitted = false;
+
+	std::vector<Network::LogEntry> log;
+	std::exception_ptr error;
+
+	// Set once the concurrent part of the commands is done
+	std::atomic<bool> mapped{false};
+};
+
 struct ToymapPass : Pass {
 	ToymapPass() : Pass("toymap", "toy technology mapping") {}
 	void help() override
@@ -1698,9 +3873,44 @@ struct ToymapPass : Pass {
 		log("    toymap [options] [selection]\n");
 		log("\n");
 		log("        -ff          do import $ff cells\n");
-		log("        -lut N       set maximum LUT arity to N\n");
+		log("        -lut N       set maximum LUT arity to N (at most 10)\n");
+		log("        -lut N,M,...\n");
+		log("                     map to each of the listed LUT arities. The network is\n");
+		log("                     imported and prepared once and copied at the first\n");
+		log("                     mapping command. The first arity is mapped into the\n");
+		log("                     module itself, the others into copies of the module\n");
+		log("                     named <module>_lut<N>. A mapping command has to come\n");
+		log("                     before any emitting one.\n");
+		log("        -j N         use N threads (default: the value of the environment\n");
+		log("                     variable TOYMAP_THREADS, or 1). With several modules\n");
+		log("                     selected, modules are mapped concurrently, while import\n");
+		log("                     and emission of RTLIL stay serial and log output is\n");
+		log("                     kept in module order. Within a module, the nodes of\n");
+		log("                     each AIG level are processed concurrently, and in the\n");
+		log("                     exact area passes the candidate cuts of each node are\n");
+		log("                     evaluated concurrently. Either way results match a\n");
+		log("                     serial run.\n");
+		log("        -reuse_cuts  keep cut sets between the passes of -depth_cuts and only\n");
+		log("                     re-rank them where the fanin sets are unchanged\n");
+		log("        -partition N\n");
+		log("                     map networks of more than 2*N nodes by windows of about\n");
+		log("                     N nodes. After a depth pass over the whole network,\n");
+		log("                     the windows are mapped independently (on separate\n");
+		log("                     threads with -j), held to the depths it found, so the\n");
+		log("                     depth is the same as without -partition. A few levels\n");
+		log("                     around each window boundary are remapped afterwards,\n");
+		log("                     but LUTs won't span the boundaries as freely as without\n");
+		log("                     -partition, which tends to cost area.\n");
+		log("        -cut_budget N\n");
+		log("                     keep N priority cuts per node on average, with more\n");
+		log("                     cuts kept on critical nodes than elsewhere\n");
 		log("        -depth_cuts  find mapping by selecting depth-minimizing cuts\n");
 		log("                     followed by passes of area recovery\n");
+		log("        -portfolio   like -depth_cuts, but try several schedules of the passes\n");
+		log("                     (on separate threads with -j) and keep the best result\n");
+		log("        -objective area|depth\n");
+		log("                     what -portfolio optimizes for first, the other breaking\n");
+		log("                     ties (default: depth)\n");
 		log("        -emit_luts   emit LUT mapping\n");
 		log("        -emit_gate2  emit 2-input gate mapping\n");
 		log("\n");
@@ -1722,12 +3932,38 @@ struct ToymapPass : Pass {
 		size_t argidx;
 
 		bool import_ff = false;
-		int lut = 4;
+		std::vector<int> luts = {4};
+		int cut_budget = 0;
+		bool reuse_cuts = false;
+		int partition_size = 0;
+		int threads = 0;
+		bool depth_first = true;
 		for (argidx = 1; argidx < args.size(); argidx++) {
 			if (args[argidx] == "-ff")
 				import_ff = true;
 			else if (args[argidx] == "-lut" && argidx + 1 < args.size())
-				lut = atoi(args[++argidx].c_str());
+			{
+				luts.clear();
+				for (auto &tok : Yosys::split_tokens(args[++argidx], ","))
+					luts.push_back(atoi(tok.c_str()));
+			}
+			else if (args[argidx] == "-j" && argidx + 1 < args.size())
+				threads = atoi(args[++argidx].c_str());
+			else if (args[argidx] == "-reuse_cuts")
+				reuse_cuts = true;
+			else if (args[argidx] == "-partition" && argidx + 1 < args.size())
+				partition_size = atoi(args[++argidx].c_str());
+			else if (args[argidx] == "-objective" && argidx + 1 < args.size()) {
+				std::string objective = args[++argidx];
+				if (objective == "depth")
+					depth_first = true;
+				else if (objective == "area")
+					depth_first = false;
+				else
+					log_cmd_error("Unknown objective: %s\n", objective.c_str());
+			}
+			else if (args[argidx] == "-cut_budget" && argidx + 1 < args.size())
+				cut_budget = atoi(args[++argidx].c_str());
 			else if (args[argidx] == "-target" && argidx + 1 < args.size())
 				++argidx;
 			else if (args[argidx][0] == '-')
@@ -1737,32 +3973,198 @@ struct ToymapPass : Pass {
 		}
 		extra_args(args, argidx, d);
 
-		LutLibrary lib = LutLibrary::academic_luts(lut);
+		if (cut_budget < 0)
+			log_cmd_error("Cut budget can't be negative.\n");
+		if (threads < 0)
+			log_cmd_error("Thread count can't be negative.\n");
+		threads = plugin_threads(threads);
+		thread_pool().resize(threads);
+		if (partition_size < 0)
+			log_cmd_error("Partition size can't be negative.\n");
+
+		if (luts.empty())
+			log_cmd_error("No LUT arity given.\n");
+		std::vector<LutLibrary> libs;
+		for (int i = 0; i < (int) luts.size(); i++) {
+			for (int j = 0; j < i; j++)
+			if (luts[j] == luts[i])
+				log_cmd_error("LUT arity %d is listed twice.\n", luts[i]);
+			libs.push_back(LutLibrary::academic_luts(luts[i]));
+		}
 
-		for (auto m : d->selected_whole_modules_warn()) {
-			log("Working on module %s\n", m->name.c_str());
+		auto is_mapping = [](const std::string &cmd) {
+			return cmd == "-trivial_cuts" || cmd == "-depth_cuts" || cmd == "-portfolio";
+		};
+		auto is_emitting = [](const std::string &cmd) {
+			return cmd == "-emit_luts" || cmd == "-emit_gate2";
+		};
+		// The network is only copied for each arity at the first mapping
+		// command, an arity would be dropped otherwise
+		if (luts.size() > 1) {
+			auto first_mapping = std::find_if(commands.begin(), commands.end(), is_mapping);
+			auto first_emitting = std::find_if(commands.begin(), commands.end(), is_emitting);
+			if (first_mapping == commands.end() || first_emitting < first_mapping)
+				log_cmd_error("Several LUT arities need a mapping command before any emitting one.\n");
+		}
+
+		std::vector<RTLIL::Module *> modules = d->selected_whole_modules_warn();
+
+		// With several modules and threads, the modules are worked on in a
+		// pipeline: this thread imports and emits them one by one in their
+		// original order, which are the only parts touching RTLIL, while
+		// the modules imported so far are mapped on the thread pool. The
+		// commands up to the first one emitting RTLIL are run concurrently,
+		// the rest are run serially at emission.
+		bool concurrent = threads > 1 && modules.size() > 1;
+		size_t nconcurrent = 0;
+		while (nconcurrent < commands.size() && !is_emitting(commands[nconcurrent]))
+			nconcurrent++;
+		bool lut_post = false;
+
+		auto run_command = [&](ModuleJob &job, const std::string &cmd) {
+			// With several LUT arities, the network is shared up to the
+			// first mapping command and copied for each arity from there
+			if (!job.forked && is_mapping(cmd)) {
+				for (int i = 1; i < (int) luts.size(); i++) {
+					job.nets.push_back(job.nets[0].copy());
+					job.targets.push_back(nullptr);
+				}
+				job.forked = true;
+			}
+
+			for (int i = 0; i < (int) job.nets.size(); i++) {
+				Network &net = job.nets[i];
+				RTLIL::Module *target = job.targets[i];
 
-			Network net;
-			net.yosys_import(m, import_ff);
-			bool emitted = false;
-			bool lut_post = false;
-			for (auto cmd : commands) {
 				if      (cmd == "-trivial_cuts")  net.trivial_cuts();
 				else if (cmd == "-scramble_lag")  net.scramble_lag();
-				else if (cmd == "-depth_cuts")    net.depth_cuts(lib);
+				else if (cmd == "-depth_cuts")    net.depth_cuts(libs[i]);
+				else if (cmd == "-portfolio")     net.portfolio_cuts(libs[i], depth_first);
 				else if (cmd == "-dump_cuts")     net.dump_cuts();
 				else if (cmd == "-unique")        net.unique();
 				else if (cmd == "-balance")		  net.balance();
 				else if (cmd == "-hash")          net.hash();
-				else if (cmd == "-emit_luts")   { net.emit_luts(m); emitted = true; lut_post = true; }
-				else if (cmd == "-emit_gate2")  { net.emit_luts(m, true); emitted = true; }
-				else log_error("Unknown command: %s\n", cmd.c_str());
- 			}
- 			if (!emitted)
- 				net.yosys_export(m);
+				else if (cmd == "-emit_luts")   { net.emit_luts(target); job.emitted = true; lut_post = true; }
+				else if (cmd == "-emit_gate2")  { net.emit_luts(target, true); job.emitted = true; }
+				else map_error("Unknown command: %s\n", cmd.c_str());
+			}
+		};
+
+		auto make_targets = [&](ModuleJob &job) {
+			for (int i = 1; i < (int) job.targets.size(); i++)
+			if (!job.targets[i]) {
+				RTLIL::Module *m = job.module;
+				RTLIL::IdString name = Yosys::stringf("%s_lut%d", m->name.c_str(), luts[i]);
+				if (d->module(name))
+					log_cmd_error("Module %s already exists.\n", name.c_str());
+				RTLIL::Module *copy = m->clone();
+				copy->name = name;
+				d->add(copy);
+				log("Mapping to %d-LUTs in module %s\n", luts[i], name.c_str());
+
+				job.nets[i].rebind_wires(copy);
+				job.targets[i] = copy;
+			}
+		};
+
+		auto import = [&](ModuleJob &job, RTLIL::Module *m) {
+			job.module = m;
+			job.nets.resize(1);
+			job.targets = {m};
+			job.forked = luts.size() == 1;
+
+			Network &net = job.nets[0];
+			if (concurrent)
+				net.log_buffer = &job.log;
+			net.nlog("Working on module %s\n", m->name.c_str());
+			net.cut_budget = cut_budget;
+			net.reuse_cuts = reuse_cuts;
+			net.partition_size = partition_size;
+			net.threads = threads;
+			net.yosys_import(m, import_ff);
+		};
+
+		auto map = [&](ModuleJob &job) {
+			try {
+				for (size_t i = 0; i < nconcurrent; i++)
+					run_command(job, commands[i]);
+			} catch (...) {
+				job.error = std::current_exception();
+			}
+			job.mapped = true;
+		};
 
- 			if (lut_post)
- 				Pass::call(d, "lutnot");
+		auto emit = [&](ModuleJob &job) {
+			for (auto &entry : job.log) {
+				if (entry.warning)
+					log_warning("%s", entry.text.c_str());
+				else
+					log("%s", entry.text.c_str());
+			}
+			job.log.clear();
+			for (auto &net : job.nets)
+				net.log_buffer = nullptr;
+			if (job.error)
+				std::rethrow_exception(job.error);
+
+			make_targets(job);
+			for (size_t i = nconcurrent; i < commands.size(); i++) {
+				run_command(job, commands[i]);
+				make_targets(job);
+			}
+			if (!job.emitted)
+			for (int i = 0; i < (int) job.nets.size(); i++)
+				job.nets[i].yosys_export(job.targets[i]);
+
+			// Done with the module, free the networks
+			job.nets.clear();
+		};
+
+		if (concurrent) {
+			// Modules imported but not yet emitted are limited to a few per
+			// thread to bound the memory held by their networks
+			size_t window = 2 * thread_pool().size();
+			std::vector<ModuleJob> jobs(modules.size());
+			ThreadPool::TaskGroup group(thread_pool());
+			size_t nimported = 0, nemitted = 0;
+			defer_errors = true;
+			try {
+				while (nemitted < jobs.size()) {
+					if (jobs[nemitted].mapped) {
+						emit(jobs[nemitted++]);
+					} else if (nimported < jobs.size() && nimported - nemitted < window) {
+						ModuleJob &job = jobs[nimported];
+						import(job, modules[nimported++]);
+						group.run([&]() { map(job); });
+					} else {
+						// Leave the mapping to the workers, as a module
+						// taken up here would hold up the pipeline
+						ModuleJob &next = jobs[nemitted];
+						group.wait_until([&]() { return next.mapped.load(); });
+					}
+				}
+			} catch (const MappingError &err) {
+				// Let the mapping in flight finish before unwinding
+				group.wait();
+				defer_errors = false;
+				log_error("%s", err.text.c_str());
+			} catch (...) {
+				group.wait();
+				defer_errors = false;
+				throw;
+			}
+			group.wait();
+			defer_errors = false;
+		} else {
+			for (auto m : modules) {
+				ModuleJob job;
+				import(job, m);
+				map(job);
+				emit(job);
+			}
 		}
+
+		if (lut_post)
+			Pass::call(d, "lutnot");
 	}
 } ToymapPass;